@@ -19,6 +19,11 @@
 
 #include "audio.h"
 #include "setup.h"
+#include "ptsqueue.h"
+
+#ifdef ENABLE_IEC61937
+#include "iec61937.h"
+#endif
 
 #include <vdr/tools.h>
 #include <vdr/remux.h>
@@ -64,6 +69,8 @@ extern "C" {
 
 // legacy libavcodec
 #if LIBAVCODEC_VERSION_MAJOR < 55
+#  define avcodec_free_context(ctx) do { avcodec_close(*(ctx)); \
+		av_freep(ctx); } while (0)
 #  define av_frame_alloc       avcodec_alloc_frame
 #  define av_frame_free        avcodec_free_frame
 #  define av_frame_unref       avcodec_get_frame_defaults
@@ -85,10 +92,28 @@ extern "C" {
 #endif
 }
 
+#include <math.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include <atomic>
+#include <string>
+#include <algorithm>
 
+// must be a multiple of the page size to allow mirroring
 #define AVPKT_BUFFER_SIZE (KILOBYTE(256))
 
+// maximum number of pending PES packets in parser, must be a power of two
+#define PTS_RING_SIZE (AVPKT_BUFFER_SIZE / 256)
+
 class cRpiAudioDecoder::cParser
 {
 
@@ -99,70 +124,177 @@ public:
 		m_channels(0),
 		m_samplingRate(0),
 		m_size(0),
-		m_parsed(true)
+		m_read(0),
+		m_base(0),
+		m_mirrored(false),
+		m_parsed(true),
+		m_parseTime(0),
+		m_crcErrors(0),
+		m_frameSamples(0),
+		m_anchorPts(OMX_INVALID_PTS),
+		m_anchorSamples(0),
+		m_gap(0)
 	{
 	}
 
+	// description of the first complete frame in the parser
+
+	struct Frame
+	{
+		cAudioCodec::eCodec codec;
+		unsigned int 		channels;
+		unsigned int 		samplingRate;
+		unsigned int 		size;		// 0 if there's no complete frame
+		unsigned int 		samples;	// per channel
+		uint8_t 			*data;
+		int64_t 			pts;		// from the PES or extrapolated
+		int64_t 			gap;		// PTS jump before this frame, if any
+		int64_t 			time;		// when the frame data has been appended
+		int64_t 			parseTime;	// spent for parsing since last call
+		unsigned int		crcErrors;	// dropped frames since last call
+	};
+
 	AVPacket* Packet(void)
 	{
 		return &m_packet;
 	}
 
-	cAudioCodec::eCodec GetCodec(void)
+	// parses the buffer if necessary and returns everything the decoder
+	// needs to know about the next frame within a single critical section
+	bool NextFrame(Frame &frame)
 	{
+		m_mutex.Lock();
 		Parse();
-		return m_codec;
+
+		frame.codec = m_codec;
+		frame.channels = m_channels;
+		frame.samplingRate = m_samplingRate;
+		frame.size = m_packet.size;
+		frame.samples = m_frameSamples;
+		frame.data = m_packet.data;
+		frame.pts = FramePts(m_ptsQueue.empty() ? OMX_INVALID_PTS :
+				m_ptsQueue.front().pts);
+		frame.time = m_ptsQueue.empty() ? 0 : m_ptsQueue.front().time;
+		frame.gap = m_gap;
+		m_gap = 0;
+		frame.parseTime = m_parseTime;
+		m_parseTime = 0;
+		frame.crcErrors = m_crcErrors;
+		m_crcErrors = 0;
+
+		m_mutex.Unlock();
+		return frame.size != 0;
 	}
 
-	unsigned int GetChannels(void)
+	unsigned int GetFreeSpace(void)
 	{
-		Parse();
-		return m_channels;
+		return AVPKT_BUFFER_SIZE - m_size - AV_INPUT_BUFFER_PADDING_SIZE;
 	}
 
-	unsigned int GetSamplingRate(void)
+	// no more PES can be appended until frames have been consumed
+	bool IsPtsQueueFull(void)
 	{
-		Parse();
-		return m_samplingRate;
+		m_mutex.Lock();
+		bool ret = m_ptsQueue.full();
+		m_mutex.Unlock();
+		return ret;
 	}
 
-	unsigned int GetFrameSize(void)
+	bool IsEmpty(void)
 	{
-		Parse();
-		return m_packet.size;
+		m_mutex.Lock();
+		bool ret = m_size == 0;
+		m_mutex.Unlock();
+		return ret;
 	}
 
-	int64_t GetPts(void)
+	// returns the size of the complete frame at the start of an unpadded
+	// buffer, if it's followed either by the end of the buffer or another
+	// valid sync word, 0 otherwise
+	static unsigned int CompleteFrame(const uint8_t *p, unsigned int size,
+			cAudioCodec::eCodec &codec, unsigned int &channels,
+			unsigned int &samplingRate, unsigned int &samples)
 	{
-		int64_t pts = OMX_INVALID_PTS;
-		m_mutex.Lock();
+		// header checks may read up to 16 bytes
+		unsigned int frameSize = 0;
+		if (size < 16)
+			return 0;
+
+		codec = CheckFrame(p, size, frameSize, channels, samplingRate);
+		if (codec == cAudioCodec::eInvalid || !frameSize || frameSize > size)
+			return 0;
 
-		if (!m_ptsQueue.empty())
-			pts = m_ptsQueue.front().pts;
+		if (frameSize < size && (size - frameSize < 4 ||
+				FastCheck(p + frameSize) == cAudioCodec::eInvalid))
+			return 0;
 
-		m_mutex.Unlock();
-		return pts;
+#ifdef ENABLE_AUDIO_CRC
+		// leave corrupted frames to the parser, which drops them
+		if (!CrcCheck(codec, p, frameSize))
+			return 0;
+#endif
+		samples = FrameSamples(codec, p);
+		return frameSize;
 	}
 
-	unsigned int GetFreeSpace(void)
+	// returns the PTS of a frame to be passed to the render without going
+	// through the parser, DirectFrameWritten() accounts its samples
+	int64_t DirectFramePts(int64_t pts, unsigned int samplingRate,
+			int64_t &gap)
 	{
-		return AVPKT_BUFFER_SIZE - m_size - AV_INPUT_BUFFER_PADDING_SIZE;
+		m_mutex.Lock();
+		if (samplingRate != m_samplingRate)
+		{
+			m_samplingRate = samplingRate;
+			m_anchorPts = OMX_INVALID_PTS;
+		}
+		pts = FramePts(pts);
+		gap = m_gap;
+		m_gap = 0;
+		m_mutex.Unlock();
+		return pts;
 	}
 
-	bool Empty(void)
+	void DirectFrameWritten(unsigned int samples)
 	{
-		Parse();
-		return m_packet.size == 0;
+		m_mutex.Lock();
+		if (m_anchorPts != OMX_INVALID_PTS)
+			m_anchorSamples += samples;
+		m_mutex.Unlock();
 	}
 
 	int Init(void)
 	{
-		if (!av_new_packet(&m_packet, AVPKT_BUFFER_SIZE))
+		if (av_new_packet(&m_packet, 0))
+			return -1;
+
+		// replace packet buffer with a ring buffer, which is mapped twice in
+		// a row, so the pending data is always contiguous in memory and
+		// consumed frames don't need to be moved to the buffer start
+		m_base = MapMirror(AVPKT_BUFFER_SIZE);
+		m_mirrored = m_base != 0;
+		if (!m_mirrored)
 		{
-			Reset();
-			return 0;
+			DLOG("failed to map audio ring buffer, using linear buffer");
+			m_base = (uint8_t*)av_malloc(AVPKT_BUFFER_SIZE);
+		}
+		AVBufferRef *buf = m_base ? av_buffer_create(m_base, AVPKT_BUFFER_SIZE,
+				m_mirrored ? &UnmapMirror : &FreeLinear, 0, 0) : 0;
+		if (!buf)
+		{
+			if (m_mirrored)
+				UnmapMirror(0, m_base);
+			else
+				av_free(m_base);
+			av_packet_unref(&m_packet);
+			return -1;
 		}
-		return -1;
+		av_buffer_unref(&m_packet.buf);
+		m_packet.buf = buf;
+		m_packet.data = m_base;
+
+		Reset();
+		return 0;
 	}
 
 	int DeInit(void)
@@ -179,9 +311,14 @@ public:
 		m_samplingRate = 0;
 		m_packet.size = 0;
 		m_size = 0;
+		m_read = 0;
+		m_packet.data = m_base;
 		m_parsed = true; // parser is empty, no need for parsing
 		memset(m_packet.data, 0, AV_INPUT_BUFFER_PADDING_SIZE);
 		m_ptsQueue.clear();
+		m_frameSamples = 0;
+		m_anchorPts = OMX_INVALID_PTS;
+		m_gap = 0;
 		m_mutex.Unlock();
 	}
 
@@ -190,14 +327,15 @@ public:
 		bool ret = true;
 		m_mutex.Lock();
 
-		if (m_size + length + AV_INPUT_BUFFER_PADDING_SIZE > AVPKT_BUFFER_SIZE)
+		if (m_size + length + AV_INPUT_BUFFER_PADDING_SIZE > AVPKT_BUFFER_SIZE
+				|| m_ptsQueue.full())
 			ret = false;
 		else
 		{
 			memcpy(m_packet.data + m_size, data, length);
 			m_size += length;
 			memset(m_packet.data + m_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
-			m_ptsQueue.emplace(Pts(pts, length));
+			m_ptsQueue.push(pts, length, cTimeUs::Now());
 
 			m_parsed = false;
 		}
@@ -211,32 +349,27 @@ public:
 
 		if (length < m_size)
 		{
-			memmove(m_packet.data, m_packet.data + length, m_size - length);
-			m_size -= length;
-			memset(m_packet.data + m_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
-
-			while (!m_ptsQueue.empty())
+			// with a mirrored buffer, just advance the read position, the
+			// padding behind the pending data is still zeroed
+			if (m_mirrored)
 			{
-				Pts& front = m_ptsQueue.front();
-				if (front.length <= length)
-				{
-					length -= front.length;
-					m_ptsQueue.pop();
-					if (!length)
-						break;
-				}
-				else
-				{
-					// clear current PTS since it's not valid anymore after
-					// shrinking the packet
-					if (!retainPts)
-						front.pts = OMX_INVALID_PTS;
-
-					front.length -= length;
-					break;
-				}
+				m_read = (m_read + length) % AVPKT_BUFFER_SIZE;
+				m_packet.data = m_base + m_read;
+				m_size -= length;
+			}
+			else
+			{
+				memmove(m_packet.data, m_packet.data + length, m_size - length);
+				m_size -= length;
+				memset(m_packet.data + m_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
 			}
 
+			// the current frame has been consumed, unless garbage is skipped
+			if (!retainPts && m_anchorPts != OMX_INVALID_PTS)
+				m_anchorSamples += m_frameSamples;
+
+			m_ptsQueue.consume(length, retainPts);
+
 			m_parsed = false;
 		}
 		else
@@ -250,6 +383,47 @@ private:
 	cParser(const cParser&);
 	cParser& operator= (const cParser&);
 
+	static uint8_t *MapMirror(size_t size)
+	{
+#ifdef SYS_memfd_create
+		int fd = syscall(SYS_memfd_create, "rpihddevice-audio", 0);
+		if (fd < 0)
+			return 0;
+
+		uint8_t *ret = 0;
+		if (!ftruncate(fd, size))
+		{
+			// reserve address space for both views, then map the file twice
+			void *base = mmap(NULL, 2 * size, PROT_NONE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (base != MAP_FAILED)
+			{
+				if (mmap(base, size, PROT_READ | PROT_WRITE,
+						MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED &&
+					mmap((uint8_t*)base + size, size, PROT_READ | PROT_WRITE,
+						MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED)
+					ret = (uint8_t*)base;
+				else
+					munmap(base, 2 * size);
+			}
+		}
+		close(fd);
+		return ret;
+#else
+		return 0;
+#endif
+	}
+
+	static void UnmapMirror(void *opaque, uint8_t *data)
+	{
+		munmap(data, 2 * AVPKT_BUFFER_SIZE);
+	}
+
+	static void FreeLinear(void *opaque, uint8_t *data)
+	{
+		av_free(data);
+	}
+
 	// Check format of first audio packet in buffer. If format has been
 	// guessed, but packet is not yet complete, codec is set with a length
 	// of 0. Once the buffer contains either the exact amount of expected
@@ -265,11 +439,14 @@ private:
 		unsigned int offset = 0;
 		unsigned int frameSize = 0;
 		unsigned int samplingRate = 0;
+		int64_t start;
 
 		m_mutex.Lock();
 		if (m_parsed)
 			goto done;
 
+		start = cTimeUs::Now();
+
 		while (m_size - offset >= 4)
 		{
 			// 0xFFE...      MPEG audio
@@ -278,45 +455,18 @@ private:
 			// 0x7FFE8001... DTS audio
 			// PCM audio can't be found
 
-			const uint8_t *p = m_packet.data + offset;
-			unsigned int n = m_size - offset;
-
-			switch (FastCheck(p))
-			{
-			case cAudioCodec::eMPG:
-				if (MpegCheck(p, n, frameSize, channels, samplingRate))
-					codec = cAudioCodec::eMPG;
-				break;
-
-			case cAudioCodec::eAC3:
-				if (Ac3Check(p, n, frameSize, channels, samplingRate))
-				{
-					codec = cAudioCodec::eAC3;
-					if (n > 5 && p[5] > (10 << 3))
-						codec = cAudioCodec::eEAC3;
-				}
-				break;
-
-			case cAudioCodec::eAAC:
-				if (AdtsCheck(p, n, frameSize, channels, samplingRate))
-					codec = cAudioCodec::eAAC;
-				break;
-
-#ifdef ENABLE_AAC_LATM
-			case cAudioCodec::eAAC_LATM:
-				if (LatmCheck(p, n, frameSize, channels, samplingRate))
-					codec = cAudioCodec::eAAC_LATM;
+			// skip all bytes which can't start a sync word at once
+			offset += FindSyncByte(m_packet.data + offset, m_size - offset - 3);
+			if (m_size - offset < 4)
 				break;
-#endif
 
-			case cAudioCodec::eDTS:
-				if (DtsCheck(p, n, frameSize, channels, samplingRate))
-					codec = cAudioCodec::eDTS;
-				break;
+			const uint8_t *p = m_packet.data + offset;
+			unsigned int n = m_size - offset;
 
-			default:
-				break;
-			}
+			cAudioCodec::eCodec found =
+					CheckFrame(p, n, frameSize, channels, samplingRate);
+			if (found != cAudioCodec::eInvalid)
+				codec = found;
 
 			if (codec != cAudioCodec::eInvalid)
 			{
@@ -330,7 +480,34 @@ private:
 					// frame from being decoded
 					if (frameSize > n)
 						frameSize = 0;
-
+#ifdef ENABLE_AUDIO_CRC
+					else if (!CrcCheck(codec, p, frameSize))
+					{
+						// without a confirmed next frame, the sync may have
+						// been found in payload, so keep scanning as after a
+						// failed header check
+						if (n < frameSize + 4)
+						{
+							codec = cAudioCodec::eInvalid;
+							++offset;
+							continue;
+						}
+
+						// drop a corrupted frame and its PTS, but account its
+						// samples, so the following frames keep their timing
+						DBG("audio parser dropped %s frame with CRC error",
+								cAudioCodec::Str(codec));
+						if (offset)
+							Shrink(offset, true);
+
+						m_frameSamples = FrameSamples(codec, m_packet.data);
+						Shrink(frameSize);
+						m_crcErrors++;
+						codec = cAudioCodec::eInvalid;
+						offset = 0;
+						continue;
+					}
+#endif
 					break;
 				}
 			}
@@ -346,31 +523,50 @@ private:
 
 		if (codec != cAudioCodec::eInvalid)
 		{
+			if (samplingRate != m_samplingRate)
+				m_anchorPts = OMX_INVALID_PTS;
+
 			m_codec = codec;
 			m_channels = channels;
 			m_samplingRate = samplingRate;
 			m_packet.size = frameSize;
+			m_frameSamples = FrameSamples(codec, m_packet.data);
 		}
 		else
 			m_packet.size = 0;
 
 		m_parsed = true;
+		m_parseTime += cTimeUs::Now() - start;
 	done:
 		m_mutex.Unlock();
 	}
 
-	struct Pts
-	{
-		Pts(int64_t _pts, unsigned int _length)
-			: pts(_pts), length(_length) { };
+	// Only the first frame starting in a PES packet carries its PTS. All other
+	// frames get a PTS extrapolated from the last one with a PTS, calculated
+	// from the total number of samples since then, so rounding errors don't
+	// accumulate.
 
-		int64_t 		pts;
-		unsigned int 	length;
-	};
-	struct PtsQueue : public std::queue<Pts>
+	int64_t FramePts(int64_t pts)
 	{
-		void clear() { c.clear(); }
-	};
+		int64_t expected = OMX_INVALID_PTS;
+		if (m_anchorPts != OMX_INVALID_PTS && m_samplingRate)
+			expected = m_anchorPts + (int64_t)((m_anchorSamples * 90000 +
+					m_samplingRate / 2) / m_samplingRate);
+
+		if (pts == OMX_INVALID_PTS)
+			return expected;
+
+		// remember deviations of the stream's PTS from the expected one, e.g.
+		// due to lost packets or cut marks, until the decoder has taken them
+		if (expected != OMX_INVALID_PTS && pts != expected)
+			m_gap = pts - expected;
+
+		m_anchorPts = pts;
+		m_anchorSamples = 0;
+		return pts;
+	}
+
+	typedef cPtsQueue<PTS_RING_SIZE, OMX_INVALID_PTS> PtsQueue;
 
 	cMutex				m_mutex;
 	AVPacket 			m_packet;
@@ -378,8 +574,17 @@ private:
 	unsigned int		m_channels;
 	unsigned int		m_samplingRate;
 	unsigned int		m_size;
+	unsigned int		m_read;
+	uint8_t				*m_base;
+	bool				m_mirrored;
 	PtsQueue	 	m_ptsQueue;
 	bool				m_parsed;
+	int64_t				m_parseTime;
+	unsigned int		m_crcErrors;
+	unsigned int		m_frameSamples;
+	int64_t				m_anchorPts;
+	uint64_t			m_anchorSamples;
+	int64_t				m_gap;
 
 	/* ---------------------------------------------------------------------- */
 	/*     audio codec parser helper functions, based on vdr-softhddevice     */
@@ -392,16 +597,152 @@ private:
 	static const uint16_t Ac3FrameSizeTable[38][3];
 	static const uint32_t DtsSampleRateTable[16];
 
+	enum eSyncByte {
+		eNoSync   = 0,
+		eSyncFF   = 1,	// MPEG, ADTS
+		eSync0B   = 2,	// (E-)AC-3
+		eSync56   = 3,	// AAC LATM
+		eSync7F   = 4	// DTS
+	};
+
+	static const uint8_t SyncByteTable[256];
+
 	static cAudioCodec::eCodec FastCheck(const uint8_t *p)
 	{
-		return 	FastMpegCheck(p)  ? cAudioCodec::eMPG      :
-				FastAc3Check (p)  ? cAudioCodec::eAC3      :
-				FastAdtsCheck(p)  ? cAudioCodec::eAAC      :
+		switch (SyncByteTable[p[0]])
+		{
+		case eSyncFF:
+			return	FastMpegCheck(p) ? cAudioCodec::eMPG :
+					FastAdtsCheck(p) ? cAudioCodec::eAAC :
+									   cAudioCodec::eInvalid;
+		case eSync0B:
+			return FastAc3Check(p) ? cAudioCodec::eAC3 : cAudioCodec::eInvalid;
+#ifdef ENABLE_AAC_LATM
+		case eSync56:
+			return FastLatmCheck(p) ? cAudioCodec::eAAC_LATM :
+					cAudioCodec::eInvalid;
+#endif
+		case eSync7F:
+			return FastDtsCheck(p) ? cAudioCodec::eDTS : cAudioCodec::eInvalid;
+		default:
+			return cAudioCodec::eInvalid;
+		}
+	}
+
+	///
+	///	Checks for a frame header of any supported codec at p.
+	///
+	static cAudioCodec::eCodec CheckFrame(const uint8_t *p, unsigned int size,
+			unsigned int &frameSize, unsigned int &channels,
+			unsigned int &samplingRate)
+	{
+		switch (FastCheck(p))
+		{
+		case cAudioCodec::eMPG:
+			if (MpegCheck(p, size, frameSize, channels, samplingRate))
+				return cAudioCodec::eMPG;
+			break;
+
+		case cAudioCodec::eAC3:
+			if (Ac3Check(p, size, frameSize, channels, samplingRate))
+				return size > 5 && p[5] > (10 << 3) ?
+						cAudioCodec::eEAC3 : cAudioCodec::eAC3;
+			break;
+
+		case cAudioCodec::eAAC:
+			if (AdtsCheck(p, size, frameSize, channels, samplingRate))
+				return cAudioCodec::eAAC;
+			break;
+
+#ifdef ENABLE_AAC_LATM
+		case cAudioCodec::eAAC_LATM:
+			if (LatmCheck(p, size, frameSize, channels, samplingRate))
+				return cAudioCodec::eAAC_LATM;
+			break;
+#endif
+
+		case cAudioCodec::eDTS:
+			if (DtsCheck(p, size, frameSize, channels, samplingRate))
+				return cAudioCodec::eDTS;
+			break;
+
+		default:
+			break;
+		}
+		return cAudioCodec::eInvalid;
+	}
+
+	///
+	///	Returns the number of samples per channel of a frame, whose header
+	///	has already been checked.
+	///
+	static unsigned int FrameSamples(cAudioCodec::eCodec codec,
+			const uint8_t *p)
+	{
+		switch (codec)
+		{
+		case cAudioCodec::eMPG:
+		{
+			int layer = 4 - ((p[1] >> 1) & 0x03);
+			return layer == 1 ? 384 : layer == 2 || (p[1] & 0x08) ? 1152 : 576;
+		}
+		case cAudioCodec::eAC3:
+			return 1536;
+
+		case cAudioCodec::eEAC3:
+		{
+			// number of audio blocks, always 6 with reduced sampling rates
+			static const unsigned int blocks[4] = { 1, 2, 3, 6 };
+			return 256 * ((p[4] & 0xC0) == 0xC0 ? 6 : blocks[(p[4] >> 4) & 0x03]);
+		}
+		case cAudioCodec::eAAC:
+			return 1024 * ((p[6] & 0x03) + 1);	// raw data blocks
+
+		case cAudioCodec::eAAC_LATM:
+			return 1024;
+
+		case cAudioCodec::eDTS:
+			return 32 * ((((p[4] & 0x01) << 6) | (p[5] >> 2)) + 1);
+
+		default:
+			return 0;
+		}
+	}
+
+	///
+	///	Returns the offset of the first byte in p[0..size) which may start a
+	///	sync word, or size if there is none.
+	///
+	static unsigned int FindSyncByte(const uint8_t *p, unsigned int size)
+	{
+		unsigned int i = 0;
+#ifdef __ARM_NEON
+		// compare 16 bytes at once and let the table find the exact position
+		// within the first block containing a candidate
+		const uint8x16_t ff = vdupq_n_u8(0xFF);
+		const uint8x16_t x0b = vdupq_n_u8(0x0B);
+		const uint8x16_t x7f = vdupq_n_u8(0x7F);
+#ifdef ENABLE_AAC_LATM
+		const uint8x16_t x56 = vdupq_n_u8(0x56);
+#endif
+		for (; i + 16 <= size; i += 16)
+		{
+			uint8x16_t v = vld1q_u8(p + i);
+			uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, ff),
+					vceqq_u8(v, x0b)), vceqq_u8(v, x7f));
 #ifdef ENABLE_AAC_LATM
-				FastLatmCheck(p)  ? cAudioCodec::eAAC_LATM :
+			m = vorrq_u8(m, vceqq_u8(v, x56));
+#endif
+			uint8x8_t r = vorr_u8(vget_low_u8(m), vget_high_u8(m));
+			if (vget_lane_u64(vreinterpret_u64_u8(r), 0))
+				break;
+		}
 #endif
-				FastDtsCheck (p)  ? cAudioCodec::eDTS      :
-									cAudioCodec::eInvalid;
+		for (; i < size; i++)
+			if (SyncByteTable[p[i]] != eNoSync)
+				return i;
+
+		return size;
 	}
 
 	///
@@ -798,6 +1139,157 @@ private:
 		if (p[10] & 0x06) channels++;
 		return true;
 	}
+
+#ifdef ENABLE_AUDIO_CRC
+	///
+	///	CRC-16 with polynomial x^16 + x^15 + x^2 + 1, as used by MPEG audio
+	///	and (E-)AC-3. The table is generated at compile time.
+	///
+	static constexpr uint16_t Crc16Entry(uint16_t crc, int bits)
+	{
+		return !bits ? crc : Crc16Entry(crc & 0x8000 ?
+				(uint16_t)((crc << 1) ^ 0x8005) : (uint16_t)(crc << 1),
+				bits - 1);
+	}
+
+	static const uint16_t Crc16Table[256];
+
+	static uint16_t Crc16(uint16_t crc, const uint8_t *p, unsigned int size)
+	{
+		while (size--)
+			crc = (crc << 8) ^ Crc16Table[(crc >> 8) ^ *p++];
+		return crc;
+	}
+
+	static uint16_t Crc16Bits(uint16_t crc, const uint8_t *p, unsigned int bits)
+	{
+		crc = Crc16(crc, p, bits / 8);
+		for (unsigned int i = 0; i < bits % 8; i++)
+			crc = (crc ^ (p[bits / 8] << (8 + i))) & 0x8000 ?
+					(crc << 1) ^ 0x8005 : crc << 1;
+		return crc;
+	}
+
+	///
+	///	Verifies the CRC of a complete frame, frames without CRC are valid.
+	///
+	///	ADTS isn't checked, since its CRC only covers parts of the raw data
+	///	blocks, which depend on the syntax elements within.
+	///
+	static bool CrcCheck(cAudioCodec::eCodec codec, const uint8_t *p,
+			unsigned int size)
+	{
+		switch (codec)
+		{
+		case cAudioCodec::eAC3:
+		case cAudioCodec::eEAC3:
+			// CRC1 and CRC2 are chosen so that the CRC of the entire frame
+			// following the sync word is zero
+			return size > 4 && !Crc16(0, p + 2, size - 2);
+
+		case cAudioCodec::eMPG:
+			return MpegCrcCheck(p, size);
+
+		default:
+			return true;
+		}
+	}
+
+	///
+	///	MPEG audio CRC covers the last two header bytes and the following
+	///	bit allocation (layer I, II), scale factor selection (layer II) or
+	///	side information (layer III), the CRC itself is stored in between.
+	///
+	static bool MpegCrcCheck(const uint8_t *p, unsigned int size)
+	{
+		// protection bit not set if CRC present
+		if (p[1] & 0x01)
+			return true;
+
+		int lsf = !(p[1] & 0x08);
+		int layer = 4 - ((p[1] >> 1) & 0x03);
+		int mode = (p[3] >> 6) & 0x03;
+		int channels = mode == 0x03 ? 1 : 2;
+
+		// joint stereo subbands start at bound
+		int bound = mode == 0x01 ? 4 + ((p[3] >> 4) & 0x03) * 4 : 32;
+		unsigned int bits = 0;
+
+		switch (layer)
+		{
+		case 1:
+			bits = 4 * (channels * bound + (32 - bound));
+			break;
+
+		case 2:
+			bits = MpegLayer2CrcBits(p, size, lsf, channels, bound);
+			break;
+
+		case 3:
+			bits = 8 * (lsf ? (channels == 1 ? 9 : 17) :
+					(channels == 1 ? 17 : 32));
+			break;
+		}
+
+		if (!bits || 6 + (bits + 7) / 8 > size)
+			return false;
+
+		return Crc16Bits(Crc16(0xFFFF, p + 2, 2), p + 6, bits) ==
+				((p[4] << 8) | p[5]);
+	}
+
+	///
+	///	Returns the number of bits protected by the CRC of an MPEG audio
+	///	layer II frame, 0 if the frame is too short.
+	///
+	static unsigned int MpegLayer2CrcBits(const uint8_t *p, unsigned int size,
+			int lsf, int channels, int bound)
+	{
+		// select allocation table according ISO 11172-3, annex B.2 and
+		// ISO 13818-3, annex B.1
+		static const int sbLimit[5] = { 27, 30, 8, 12, 30 };
+		int table = 4;
+		if (!lsf)
+		{
+			int rate = MpegSampleRateTable[(p[2] >> 2) & 0x03];
+			int bitRate = BitRateTable[0][1][(p[2] >> 4) & 0x0F] / channels;
+			table = (rate == 48000 && bitRate >= 56) ||
+					(bitRate >= 56 && bitRate <= 80) ? 0 :
+					rate != 48000 && bitRate >= 96 ? 1 :
+					rate != 32000 && bitRate <= 48 ? 2 : 3;
+		}
+		if (bound > sbLimit[table])
+			bound = sbLimit[table];
+
+		const uint8_t *data = p + 6;
+		unsigned int bits = 0, scfsi = 0;
+
+		for (int sb = 0; sb < sbLimit[table]; sb++)
+		{
+			// number of bits for the allocation of this subband
+			int nbal = table < 2 ? (sb < 11 ? 4 : sb < 23 ? 3 : 2) :
+					table < 4 ? (sb < 2 ? 4 : 3) :
+							(sb < 4 ? 4 : sb < 11 ? 3 : 2);
+
+			for (int ch = 0; ch < (sb < bound ? channels : 1); ch++)
+			{
+				if (6 + (bits + nbal + 7) / 8 > size)
+					return 0;
+
+				unsigned int alloc = 0;
+				for (int i = 0; i < nbal; i++, bits++)
+					alloc = (alloc << 1) |
+							((data[bits / 8] >> (7 - bits % 8)) & 0x01);
+
+				// joint stereo subbands share the allocation, but each
+				// channel has its own scale factor selection
+				if (alloc)
+					scfsi += sb < bound ? 2 : 2 * channels;
+			}
+		}
+		return bits + scfsi;
+	}
+#endif
 };
 
 ///
@@ -859,14 +1351,62 @@ const uint16_t cRpiAudioDecoder::cParser::Ac3FrameSizeTable[38][3] =
 };
 
 ///
-///	DTS sample rate table.
+///	Classification of the first byte of all supported sync words.
 ///
-const uint32_t cRpiAudioDecoder::cParser::DtsSampleRateTable[16] =
-	{ 0,  8000, 16000, 32000, 64000,
-	  0, 11025, 22050, 44100, 88200,
-	  0, 12000, 24000, 48000, 96000, 0 };
+#ifdef ENABLE_AAC_LATM
+#define SYNC_56 eSync56
+#else
+#define SYNC_56 eNoSync
+#endif
+const uint8_t cRpiAudioDecoder::cParser::SyncByteTable[256] =
+{
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, eSync0B, 0, 0, 0, 0,	// 0x00
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,			// 0x10
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,			// 0x20
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,			// 0x30
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,			// 0x40
+	0, 0, 0, 0, 0, 0, SYNC_56, 0, 0, 0, 0, 0, 0, 0, 0, 0,	// 0x50
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,			// 0x60
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, eSync7F,	// 0x70
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,			// 0x80
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,			// 0x90
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,			// 0xA0
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,			// 0xB0
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,			// 0xC0
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,			// 0xD0
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,			// 0xE0
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, eSyncFF	// 0xF0
+};
+#undef SYNC_56
 
-/* ------------------------------------------------------------------------- */
+#ifdef ENABLE_AUDIO_CRC
+///
+///	CRC-16 table, polynomial 0x8005.
+///
+#define CRC16(i)     Crc16Entry((i) << 8, 8)
+#define CRC16_4(i)   CRC16(i), CRC16(i + 1), CRC16(i + 2), CRC16(i + 3)
+#define CRC16_16(i)  CRC16_4(i), CRC16_4(i + 4), CRC16_4(i + 8), CRC16_4(i + 12)
+#define CRC16_64(i)  CRC16_16(i), CRC16_16(i + 16), CRC16_16(i + 32), \
+		CRC16_16(i + 48)
+const uint16_t cRpiAudioDecoder::cParser::Crc16Table[256] =
+{
+	CRC16_64(0), CRC16_64(64), CRC16_64(128), CRC16_64(192)
+};
+#undef CRC16_64
+#undef CRC16_16
+#undef CRC16_4
+#undef CRC16
+#endif
+
+///
+///	DTS sample rate table.
+///
+const uint32_t cRpiAudioDecoder::cParser::DtsSampleRateTable[16] =
+	{ 0,  8000, 16000, 32000, 64000,
+	  0, 11025, 22050, 44100, 88200,
+	  0, 12000, 24000, 48000, 96000, 0 };
+
+/* ------------------------------------------------------------------------- */
 
 #define AV_CH_LAYOUT(ch) ( \
 		ch == 1 ? AV_CH_LAYOUT_MONO    : \
@@ -888,13 +1428,326 @@ const uint32_t cRpiAudioDecoder::cParser::DtsSampleRateTable[16] =
 
 /* ------------------------------------------------------------------------- */
 
+// Conversion of planar float samples, as output by the AC-3, E-AC-3 and AAC
+// decoders, to interleaved S16 for the channel layouts common in broadcasting.
+// Channels are in libav order (FL, FR, FC, LFE, SL, SR), which the HDMI
+// channel mapping is set up for. Other formats are left to the resampler.
+
+class cRpiPcmKernel
+{
+
+public:
+
+	typedef void (*tConvert)(int16_t *dst, const float * const *src,
+			int samples);
+
+	static tConvert Get(AVSampleFormat format, unsigned int inChannels,
+			unsigned int outChannels)
+	{
+		if (format != AV_SAMPLE_FMT_FLTP)
+			return 0;
+
+		return	inChannels == 2 && outChannels == 2 ? &Interleave<2> :
+				inChannels == 6 && outChannels == 6 ? &Interleave<6> :
+				inChannels == 6 && outChannels == 2 ? &Downmix        : 0;
+	}
+
+	static const char* Str(tConvert kernel) {
+		return	kernel == &Interleave<2> ? "FLTP 2.0 to S16 2.0" :
+				kernel == &Interleave<6> ? "FLTP 5.1 to S16 5.1" :
+				kernel == &Downmix       ? "FLTP 5.1 to S16 2.0" : "none";
+	}
+
+private:
+
+	cRpiPcmKernel();
+
+	// same coefficients as libswresample's default matrix: center and
+	// surround at -3dB, no LFE, normalized to prevent clipping
+	static constexpr float FrontGain = 1.0f / (1.0f + 2 * 0.70710678f);
+	static constexpr float MixGain = 0.70710678f * FrontGain;
+
+	static int16_t ToS16(float sample)
+	{
+		int s = lrintf(sample * 32768.0f);
+		return s > INT16_MAX ? INT16_MAX : s < INT16_MIN ? INT16_MIN : s;
+	}
+
+#ifdef __ARM_NEON
+	// rounds to nearest like the scalar version, instead of truncating
+	static int16x4_t ToS16(float32x4_t samples)
+	{
+		samples = vmulq_n_f32(samples, 32768.0f);
+#ifdef __aarch64__
+		return vqmovn_s32(vcvtnq_s32_f32(samples));
+#else
+		uint32x4_t sign = vandq_u32(vreinterpretq_u32_f32(samples),
+				vdupq_n_u32(0x80000000));
+		float32x4_t half = vreinterpretq_f32_u32(
+				vorrq_u32(vreinterpretq_u32_f32(vdupq_n_f32(0.5f)), sign));
+		return vqmovn_s32(vcvtq_s32_f32(vaddq_f32(samples, half)));
+#endif
+	}
+#endif
+
+	template<int channels>
+	static void Interleave(int16_t *dst, const float * const *src, int samples)
+	{
+		int i = 0;
+#ifdef __ARM_NEON
+		for (; i + 4 <= samples; i += 4, dst += 4 * channels)
+		{
+			if (channels == 2)
+			{
+				int16x4x2_t out = {{ ToS16(vld1q_f32(src[0] + i)),
+						ToS16(vld1q_f32(src[1] + i)) }};
+				vst2_s16(dst, out);
+			}
+			else
+			{
+				// store channel pairs as 32 bit words, three of them per frame
+				int32x4x3_t out;
+				for (int c = 0; c < 3; c++)
+				{
+					int16x4x2_t pair = vzip_s16(
+							ToS16(vld1q_f32(src[2 * c] + i)),
+							ToS16(vld1q_f32(src[2 * c + 1] + i)));
+					out.val[c] = vreinterpretq_s32_s16(
+							vcombine_s16(pair.val[0], pair.val[1]));
+				}
+				vst3q_s32((int32_t *)dst, out);
+			}
+		}
+#endif
+		for (; i < samples; i++)
+			for (int c = 0; c < channels; c++)
+				*dst++ = ToS16(src[c][i]);
+	}
+
+	static void Downmix(int16_t *dst, const float * const *src, int samples)
+	{
+		const float *fl = src[0], *fr = src[1], *fc = src[2];
+		const float *sl = src[4], *sr = src[5];
+
+		int i = 0;
+#ifdef __ARM_NEON
+		for (; i + 4 <= samples; i += 4, dst += 8)
+		{
+			float32x4_t c = vmulq_n_f32(vld1q_f32(fc + i), MixGain);
+			float32x4_t l = vmlaq_n_f32(c, vld1q_f32(fl + i), FrontGain);
+			float32x4_t r = vmlaq_n_f32(c, vld1q_f32(fr + i), FrontGain);
+			l = vmlaq_n_f32(l, vld1q_f32(sl + i), MixGain);
+			r = vmlaq_n_f32(r, vld1q_f32(sr + i), MixGain);
+
+			int16x4x2_t out = {{ ToS16(l), ToS16(r) }};
+			vst2_s16(dst, out);
+		}
+#endif
+		for (; i < samples; i++)
+		{
+			float c = fc[i] * MixGain;
+			*dst++ = ToS16(fl[i] * FrontGain + c + sl[i] * MixGain);
+			*dst++ = ToS16(fr[i] * FrontGain + c + sr[i] * MixGain);
+		}
+	}
+};
+
+constexpr float cRpiPcmKernel::FrontGain;
+constexpr float cRpiPcmKernel::MixGain;
+
+/* ------------------------------------------------------------------------- */
+
+// maximum duration of decoded audio packed into one OMX buffer, in 90kHz ticks
+#define PCM_PACK_LATENCY (90000 * 50 / 1000)
+
+// below this amount of available memory, unused decoders get closed
+#define CODEC_MEM_LOW_KB (32 * 1024)
+
+// number of initialized resampler contexts kept for reuse
+#define RESAMPLER_CACHE_SIZE 4
+
+// always submit decoded audio right away below this number of queued buffers
+#define PCM_PACK_MIN_QUEUED 2
+
+// maximum deviation of a PTS from its expected value to append its frame to
+// the current buffer, in 90kHz ticks
+#define PCM_PTS_TOLERANCE (90000 * 5 / 1000)
+
+// maximum gap in decoded audio to be filled with silence, in 90kHz ticks
+#define PCM_GAP_MAX (90000 * 250 / 1000)
+
+// duration of the alternate audio track kept in its parser, in 90kHz ticks
+#define ALTERNATE_TRACK_HOLD (90000 * 1)
+
+/* ------------------------------------------------------------------------- */
+
+// processing time per frame and stage, with an exponential moving average
+// and the maximum of the current and the previous second
+
+class cRpiAudioStats
+{
+
+public:
+
+	enum eStage {
+		eParse,
+		eDecode,
+		eResample,
+		eSubmit,
+		eWait,
+		eNumStages
+	};
+
+	static const char* Str(eStage stage) {
+		return	stage == eParse    ? "parse"    :
+				stage == eDecode   ? "decode"   :
+				stage == eResample ? "resample" :
+				stage == eSubmit   ? "submit"   :
+				stage == eWait     ? "wait"     : "unknown";
+	}
+
+	enum eCounter {
+		eInputWakeup,
+		eRenderWakeup,
+		eUnderrun,
+		eDirectFrame,
+		eFilledGap,
+		eDiscontinuity,
+		eCrcError,
+		eStageFailure,
+		eNumCounters
+	};
+
+	static const char* Str(eCounter counter) {
+		return	counter == eInputWakeup  ? "input wakeups"  :
+				counter == eRenderWakeup ? "render wakeups" :
+				counter == eUnderrun     ? "underruns"      :
+				counter == eDirectFrame  ? "direct pass-through frames" :
+				counter == eFilledGap    ? "gaps filled with silence" :
+				counter == eDiscontinuity ? "discontinuities" :
+				counter == eCrcError     ? "frames with CRC error" :
+				counter == eStageFailure ? "failed staging allocations" :
+						"unknown";
+	}
+
+	cRpiAudioStats()
+	{
+		Reset(0);
+	}
+
+	void Reset(int64_t cpuTime)
+	{
+		m_mutex.Lock();
+		memset(m_stages, 0, sizeof(m_stages));
+		for (int i = 0; i < eNumCounters; i++)
+			m_counters[i].store(0, std::memory_order_relaxed);
+		m_resetTime = cTimeUs::Now();
+		m_resetCpuTime = cpuTime;
+		m_window.Set(1000);
+		m_mutex.Unlock();
+	}
+
+	void Add(eStage stage, int64_t us)
+	{
+		m_mutex.Lock();
+		if (m_window.TimedOut())
+		{
+			for (int i = 0; i < eNumStages; i++)
+			{
+				m_stages[i].lastMax = m_stages[i].windowMax;
+				m_stages[i].windowMax = 0;
+			}
+			m_window.Set(1000);
+		}
+
+		tStage &s = m_stages[stage];
+		s.avg = s.count ? s.avg + (us - s.avg) / 16.0 : us;
+		s.count++;
+		s.total += us;
+		if (us > s.windowMax)
+			s.windowMax = us;
+		if (us > s.max)
+			s.max = us;
+		m_mutex.Unlock();
+	}
+
+	// may be called from any thread without locking
+	void Count(eCounter counter, unsigned int n = 1)
+	{
+		m_counters[counter].fetch_add(n, std::memory_order_relaxed);
+	}
+
+	cString Dump(int64_t cpuTime)
+	{
+		std::string ret;
+		char line[128];
+
+		m_mutex.Lock();
+		double elapsed = (cTimeUs::Now() - m_resetTime) / 1000000.0;
+		snprintf(line, sizeof(line), "CPU load: %.1f%% within %.0fs\n",
+				cpuTime > m_resetCpuTime && elapsed > 0 ?
+						(cpuTime - m_resetCpuTime) / 10000.0 / elapsed : 0.0,
+				elapsed);
+		ret += line;
+
+		snprintf(line, sizeof(line), "%-8s %8s %8s %8s %8s %8s\n", "stage",
+				"count", "mean/us", "avg/us", "max1s/us", "max/us");
+		ret += line;
+
+		for (int i = 0; i < eNumStages; i++)
+		{
+			tStage &s = m_stages[i];
+			snprintf(line, sizeof(line), "%-8s %8u %8lld %8.0f %8lld %8lld\n",
+					Str((eStage)i), s.count,
+					s.count ? (long long)(s.total / s.count) : 0LL, s.avg,
+					(long long)std::max(s.windowMax, s.lastMax),
+					(long long)s.max);
+			ret += line;
+		}
+		m_mutex.Unlock();
+
+		for (int i = 0; i < eNumCounters; i++)
+		{
+			snprintf(line, sizeof(line), "%s: %u\n", Str((eCounter)i),
+					m_counters[i].load(std::memory_order_relaxed));
+			ret += line;
+		}
+
+		// SVDRP replies must not end with a line break
+		ret.resize(ret.size() - 1);
+		return cString(ret.c_str());
+	}
+
+private:
+
+	struct tStage
+	{
+		unsigned int count;
+		int64_t      total;
+		double       avg;
+		int64_t      windowMax;
+		int64_t      lastMax;
+		int64_t      max;
+	};
+
+	cMutex  m_mutex;
+	cTimeMs m_window;
+	tStage  m_stages[eNumStages];
+	std::atomic<unsigned int> m_counters[eNumCounters];
+	int64_t m_resetTime;
+	int64_t m_resetCpuTime;
+};
+
+/* ------------------------------------------------------------------------- */
+
 class cRpiAudioRender
 {
 
 public:
 
-	cRpiAudioRender(cOmx *omx) :
+	cRpiAudioRender(cOmx *omx, cRpiAudioStats *stats) :
 		m_omx(omx),
+		m_stats(stats),
 		m_port(cRpiAudioPort::eLocal),
 		m_codec(cAudioCodec::eInvalid),
 		m_inChannels(0),
@@ -903,31 +1756,308 @@ public:
 		m_frameSize(0),
 		m_configured(false),
 		m_running(false),
+		m_started(false),
+		m_discontinuity(false),
+		m_renderSamplingRate(0),
+		m_drainTime(0),
 #ifdef DO_RESAMPLE
 		m_resample(0),
+		m_kernel(0),
 		m_resamplerConfigured(false),
+		m_resamplerUse(0),
 #endif
 		m_pcmSampleFormat(AV_SAMPLE_FMT_NONE),
+		m_stage(0),
+		m_stageSize(0),
+		m_stageStart(0),
+		m_stageEnd(0),
+		m_stageBytesPerSample(0),
+		m_stageSamplingRate(0),
+		m_stageFull(false),
+		m_stagedTime(0),
+		m_outputThread(this),
+		m_outputThreadEnabled(false),
 		m_pts(0)
 	{
+#ifdef DO_RESAMPLE
+		memset(m_resamplers, 0, sizeof(m_resamplers));
+#endif
 	}
 
 	~cRpiAudioRender()
 	{
+		SetOutputThread(false);
 		Flush();
+		free(m_stage);
 #ifdef DO_RESAMPLE
-		swr_free(&m_resample);
+		for (int i = 0; i < RESAMPLER_CACHE_SIZE; i++)
+			swr_free(&m_resamplers[i].context);
 #endif
 	}
 
 	int WriteSamples(uint8_t** data, int samples, int64_t pts,
 			AVSampleFormat sampleFormat = AV_SAMPLE_FMT_NONE)
+	{
+		m_mutex.Lock();
+		int ret = Write(data, samples, pts, sampleFormat);
+		m_mutex.Unlock();
+		return ret;
+	}
+
+	// to be called when there's no more data to be written for now, submits
+	// staged samples as far as the render has buffers left; starved tells
+	// that there's no input, so running dry afterwards is no underrun
+	void Idle(bool starved)
+	{
+		m_mutex.Lock();
+#ifdef ENABLE_IEC61937
+		WriteBursts();
+		if (m_iec.HasBurst())
+			starved = false;
+#endif
+		Output();
+		if (starved && m_stageEnd == m_stageStart)
+			m_started = false;
+		m_mutex.Unlock();
+	}
+
+	void Flush(void)
+	{
+		m_mutex.Lock();
+		m_stageStart = 0;
+		m_stageEnd = 0;
+		m_stageFull = false;
+		m_stagedTime = 0;
+		if (m_running)
+			m_omx->StopAudio();
+		m_configured = false;
+		m_running = false;
+		m_started = false;
+		m_discontinuity = false;
+		m_drainTime = 0;
+		m_pts = 0;
+#ifdef ENABLE_IEC61937
+		m_iec.Reset();
+#endif
+		m_mutex.Unlock();
+	}
+
+	// marks the next buffer as discontinuous to the previous one
+	void SetDiscontinuity(void)
+	{
+		m_mutex.Lock();
+		if (!m_discontinuity)
+			m_stats->Count(cRpiAudioStats::eDiscontinuity);
+		m_discontinuity = true;
+		m_mutex.Unlock();
+	}
+
+	// lets a separate thread submit decoded audio to the render
+	void SetOutputThread(bool enable)
+	{
+		if (enable == m_outputThreadEnabled)
+			return;
+
+		m_outputThreadEnabled = enable;
+		if (enable)
+			m_outputThread.Start();
+		else
+			m_outputThread.Stop();
+
+		DLOG("audio output thread %s", enable ? "started" : "stopped");
+	}
+
+	// to be called when the render has emptied a buffer
+	void SignalOutput(void)
+	{
+		if (m_outputThreadEnabled)
+			m_outputThread.Signal();
+	}
+
+	void SetCodec(cAudioCodec::eCodec codec, unsigned int channels,
+			unsigned int samplingRate, unsigned int frameSize)
+	{
+		if (codec != cAudioCodec::eInvalid && channels > 0)
+		{
+			m_inChannels = channels;
+			cRpiAudioPort::ePort newPort = cRpiSetup::GetAudioPort();
+			cAudioCodec::eCodec newCodec = cAudioCodec::ePCM;
+
+			DLOG("new audio codec: %dch %s", channels, cAudioCodec::Str(codec));
+
+			if (newPort == cRpiAudioPort::eHDMI)
+			{
+				// check if pass through is possible
+				if (cRpiSetup::IsAudioFormatSupported(codec, channels,
+							samplingRate))
+					newCodec = codec;
+
+				// check for multi channel PCM, stereo downmix if not supported
+				else if (!cRpiSetup::IsAudioFormatSupported(cAudioCodec::ePCM,
+						channels, samplingRate))
+					channels = 2;
+			}
+			else
+				channels = 2;
+
+			// if the user changes the port, this should change immediately
+			if (newPort != m_port)
+				Flush();
+
+			// save new settings to be applied when render is ready
+			if (newPort != m_port || m_codec != newCodec ||
+					m_outChannels != channels || m_samplingRate != samplingRate)
+			{
+				m_configured = false;
+				m_port = newPort;
+				m_codec = newCodec;
+				m_outChannels = channels;
+				m_samplingRate = samplingRate;
+				m_frameSize = frameSize;
+			}
+#ifdef DO_RESAMPLE
+			m_resamplerConfigured = false;
+#endif
+		}
+	}
+
+	bool IsPassthrough(void)
+	{
+		return m_codec != cAudioCodec::ePCM;
+	}
+
+	// true if frames of the given format can be passed through right away
+	bool AcceptsPassthrough(cAudioCodec::eCodec codec, unsigned int channels,
+			unsigned int samplingRate)
+	{
+		return m_configured && IsPassthrough() && m_codec == codec &&
+				m_inChannels == channels && m_samplingRate == samplingRate;
+	}
+
+	int GetChannels(void)
+	{
+		return m_outChannels;
+	}
+
+	bool Ready(void)
+	{
+		if (!m_configured)
+		{
+			// staged PCM data belongs to the current settings
+			Drain(true);
+			if (m_stageEnd > m_stageStart)
+			{
+				m_drainTime = 0;
+				return false;
+			}
+
+			// wait until render is ready before applying new settings
+			if (m_running)
+				if (unsigned int latency = m_omx->GetAudioLatency())
+				{
+					m_drainTime = m_renderSamplingRate ?
+							latency * 1000 / m_renderSamplingRate + 1 : 1;
+					return false;
+				}
+
+			m_drainTime = 0;
+			ApplyRenderSettings();
+		}
+		return true;
+	}
+
+	// duration of decoded audio in ms waiting for a render buffer, may be
+	// called from any thread
+	int GetStagedTime(void)
+	{
+		return m_stagedTime;
+	}
+
+	// time in ms until pending samples should have been played while waiting
+	// for the render to apply new settings, 0 if not waiting
+	int GetDrainTime(void)
+	{
+		return m_drainTime;
+	}
+
+private:
+
+	cRpiAudioRender(const cRpiAudioRender&);
+	cRpiAudioRender& operator= (const cRpiAudioRender&);
+
+	// submits staged samples on its own thread, so the next frame can be
+	// decoded while the previous ones are copied and queued to the render
+
+	class cOutputThread : public cThread
+	{
+
+	public:
+
+		cOutputThread(cRpiAudioRender *render) :
+			cThread("audio output"),
+			m_render(render) { }
+
+		void Stop(void)
+		{
+			Cancel(-1);
+			m_wait.Signal();
+
+			while (Active())
+				cCondWait::SleepMs(5);
+		}
+
+		void Signal(void)
+		{
+			m_wait.Signal();
+		}
+
+	protected:
+
+		virtual void Action(void)
+		{
+			SetPriority(-15);
+			while (Running())
+			{
+				m_render->m_mutex.Lock();
+				m_render->Drain();
+				m_render->m_mutex.Unlock();
+
+				// woken by the decoder and by emptied render buffers, which
+				// is also when partially filled buffers become due
+				m_wait.Wait(0);
+			}
+		}
+
+	private:
+
+		cRpiAudioRender *m_render;
+		cCondWait        m_wait;
+	};
+
+	int Write(uint8_t** data, int samples, int64_t pts,
+			AVSampleFormat sampleFormat)
 	{
 		if (!Ready())
 			return 0;
 
 		int copied = 0;
+		int64_t start = cTimeUs::Now();
+		int64_t resampleTime = 0;
 
+#ifdef ENABLE_IEC61937
+		if (sampleFormat == AV_SAMPLE_FMT_NONE && IsIec61937())
+		{
+			// a pending burst has to be written before adding the next frame
+			while (!m_iec.Add(m_codec, *data, samples, pts))
+				if (!WriteBursts())
+					return 0;
+
+			// otherwise written with the next frame or when idle
+			WriteBursts();
+			copied = samples;
+		}
+		else
+#endif
 		if (sampleFormat == AV_SAMPLE_FMT_NONE)
 		{
 			// pass through
@@ -937,6 +2067,9 @@ public:
 				if (!buf)
 					break;
 
+				// compressed audio can't be padded, let the render resync
+				SetDiscontinuityFlag(buf);
+
 				unsigned int len = samples - copied;
 				if (len > buf->nAllocLen)
 					len = buf->nAllocLen;
@@ -944,11 +2077,12 @@ public:
 				memcpy(buf->pBuffer, *data + copied, len);
 				buf->nFilledLen = len;
 
-				if (!m_omx->EmptyAudioBuffer(buf))
+				if (!Submit(buf))
 					break;
 
+				// remaining chunks of the frame have no time of their own
 				copied += len;
-				pts = 0;
+				pts = OMX_INVALID_PTS;
 			}
 		}
 		else
@@ -960,138 +2094,281 @@ public:
 				m_pcmSampleFormat = sampleFormat;
 				ApplyResamplerSettings();
 			}
-			if (m_resample)
+			if (!m_resample && !m_kernel)
+				return 0;
+#endif
+			// local decode, stage the samples until the render has a buffer
+			// for them. Once the latency target is reached, no more frames
+			// are taken until half of it has been played, so decoding runs
+			// in bursts instead of waiting for every single buffer
+			Output();
+			if (m_stageFull)
+				return 0;
+
+			bool hasPts = pts && pts != OMX_INVALID_PTS;
+			unsigned int bytesPerSample = m_outChannels *
+					av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
+			if (m_stageEnd == m_stageStart)
 			{
-				m_pts = pts ? pts : m_pts;
-				OMX_BUFFERHEADERTYPE *buf = m_omx->GetAudioBuffer(m_pts);
-				if (buf)
-				{
-					if (buf->nAllocLen >= (samples * m_outChannels *
-						av_get_bytes_per_sample(AV_SAMPLE_FMT_S16)))
-					{
-						uint8_t *dst[] = { buf->pBuffer };
-						int copiedSamples = swr_convert(m_resample,
-							dst, samples, (const uint8_t **)data, samples);
+				m_stageBytesPerSample = bytesPerSample;
+				m_stageSamplingRate = m_samplingRate;
+			}
+
+			// fill short gaps with silence to keep the audio clock continuous,
+			// restart the staged audio for the render to resync on any other
+			// jump
+			bool jump = hasPts && m_pts &&
+					llabs(pts - m_pts) > PCM_PTS_TOLERANCE;
+			if (jump && pts > m_pts && pts - m_pts <= PCM_GAP_MAX)
+			{
+				if (!InsertSilence(pts))
+					return 0;
+
+				m_stats->Count(cRpiAudioStats::eFilledGap);
+				jump = false;
+			}
+			if (jump)
+			{
+				// samples before the jump have to be submitted first
+				Drain(true);
+				if (m_stageEnd > m_stageStart)
+					return 0;
 
-						buf->nFilledLen = av_samples_get_buffer_size(NULL,
-							m_outChannels, copiedSamples, AV_SAMPLE_FMT_S16, 1);
+				SetDiscontinuity();
+			}
+			if (hasPts)
+				m_pts = pts;
+
+			// keep the frame to try again, instead of silently dropping it
+			if (!Reserve(samples * bytesPerSample))
+				return 0;
+
+			uint8_t *dst[] = { m_stage + m_stageEnd };
+#ifdef DO_RESAMPLE
+			int64_t resampleStart = cTimeUs::Now();
+			int copiedSamples = samples;
+			if (m_kernel)
+				m_kernel((int16_t *)dst[0], (const float * const *)data, samples);
+			else
+				copiedSamples = swr_convert(m_resample,
+					dst, samples, (const uint8_t **)data, samples);
+			resampleTime = cTimeUs::Now() - resampleStart;
+			m_stats->Add(cRpiAudioStats::eResample, resampleTime);
+#else
+			int copiedSamples = samples;
+			memcpy(dst[0], *data, samples * bytesPerSample);
+#endif
+			if (copiedSamples > 0)
+			{
+				m_stageEnd += copiedSamples * bytesPerSample;
+				if (m_pts)
+					m_pts += copiedSamples * 90000 / m_samplingRate;
+			}
+			copied = samples;
+
+			if (CalcStagedTime() >= cRpiSetup::GetAudioLatencyTarget())
+				m_stageFull = true;
+
+			Output();
+		}
+		if (copied)
+			m_stats->Add(cRpiAudioStats::eSubmit,
+					cTimeUs::Now() - start - resampleTime);
+		return copied;
+	}
+
+	// submits staged samples, or lets the output thread do so if enabled
+	void Output(void)
+	{
+		if (m_outputThreadEnabled)
+			m_outputThread.Signal();
+		else
+			Drain();
+	}
+
+	bool Submit(OMX_BUFFERHEADERTYPE *buf)
+	{
+		// render has run dry if it played everything since the last buffer
+		// while input was pending
+		if (m_started && !m_omx->GetQueuedAudioBuffers())
+			m_stats->Count(cRpiAudioStats::eUnderrun);
+
+		if (!m_omx->EmptyAudioBuffer(buf))
+			return false;
+
+		m_started = true;
+		return true;
+	}
+
+	void SetDiscontinuityFlag(OMX_BUFFERHEADERTYPE *buf)
+	{
+		if (m_discontinuity)
+		{
+			buf->nFlags |= OMX_BUFFERFLAG_DISCONTINUITY;
+			m_discontinuity = false;
+		}
+	}
+
+	// writes silence up to the given PTS into the staged samples
+	bool InsertSilence(int64_t pts)
+	{
+		unsigned int samples = (pts - m_pts) * m_samplingRate / 90000;
+		if (!Reserve(samples * m_stageBytesPerSample))
+			return false;
+
+		memset(m_stage + m_stageEnd, 0, samples * m_stageBytesPerSample);
+		m_stageEnd += samples * m_stageBytesPerSample;
+		m_pts += samples * 90000 / m_samplingRate;
+		return true;
+	}
+
+	// makes room for the given number of bytes behind the staged samples
+	bool Reserve(unsigned int size)
+	{
+		if (m_stageEnd + size <= m_stageSize)
+			return true;
+
+		if (m_stageStart)
+		{
+			memmove(m_stage, m_stage + m_stageStart, m_stageEnd - m_stageStart);
+			m_stageEnd -= m_stageStart;
+			m_stageStart = 0;
+		}
+		if (m_stageEnd + size > m_stageSize)
+		{
+			// keep room for the whole latency target, so this rarely happens
+			unsigned int stageSize = m_stageEnd + size +
+					cRpiSetup::GetAudioLatencyTarget() * m_stageSamplingRate /
+					1000 * m_stageBytesPerSample;
 
-						m_pts += copiedSamples * 90000 / m_samplingRate;
-					}
-					copied = m_omx->EmptyAudioBuffer(buf) ? samples : 0;
-				}
-			}
-#else
-			// local decode, no resampling
-			if (pts)
-				m_pts = pts;
-			OMX_BUFFERHEADERTYPE *buf = m_omx->GetAudioBuffer(m_pts);
-			if (buf)
+			uint8_t *stage = (uint8_t *)realloc(m_stage, stageSize);
+			if (!stage)
 			{
-				unsigned int size = samples * m_outChannels *
-						av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
-				if (buf->nAllocLen >= size)
-				{
-					memcpy(buf->pBuffer, *data, size);
-					buf->nFilledLen = size;
-					m_pts += samples * 90000 / m_samplingRate;
-				}
-				copied = m_omx->EmptyAudioBuffer(buf) ? samples : 0;
+				ELOG("failed to allocate %u bytes for staged audio!", stageSize);
+				m_stats->Count(cRpiAudioStats::eStageFailure);
+				return false;
 			}
-#endif
+			m_stage = stage;
+			m_stageSize = stageSize;
 		}
-		return copied;
+		return true;
 	}
 
-	void Flush(void)
+	int CalcStagedTime(void)
 	{
-		if (m_running)
-			m_omx->StopAudio();
-		m_configured = false;
-		m_running = false;
-		m_pts = 0;
+		return m_stageBytesPerSample && m_stageSamplingRate ?
+				(int64_t)(m_stageEnd - m_stageStart) / m_stageBytesPerSample *
+				1000 / m_stageSamplingRate : 0;
 	}
 
-	void SetCodec(cAudioCodec::eCodec codec, unsigned int channels,
-			unsigned int samplingRate, unsigned int frameSize)
+	// submits staged samples in buffers of up to PCM_PACK_LATENCY, as long as
+	// the render has buffers left. Unless forced, a shorter buffer is only
+	// submitted if the render is about to run dry.
+	void Drain(bool force = false)
 	{
-		if (codec != cAudioCodec::eInvalid && channels > 0)
+		if (m_stageEnd > m_stageStart)
 		{
-			m_inChannels = channels;
-			cRpiAudioPort::ePort newPort = cRpiSetup::GetAudioPort();
-			cAudioCodec::eCodec newCodec = cAudioCodec::ePCM;
-
-			DLOG("new audio codec: %dch %s", channels, cAudioCodec::Str(codec));
+			unsigned int chunk = PCM_PACK_LATENCY * m_stageSamplingRate /
+					90000 * m_stageBytesPerSample;
 
-			if (newPort == cRpiAudioPort::eHDMI)
+			while (m_stageEnd > m_stageStart)
 			{
-				// check if pass through is possible
-				if (cRpiSetup::IsAudioFormatSupported(codec, channels,
-							samplingRate))
-					newCodec = codec;
+				unsigned int len = m_stageEnd - m_stageStart;
+				if (len < chunk && !force &&
+						m_omx->GetQueuedAudioBuffers() >= PCM_PACK_MIN_QUEUED)
+					break;
 
-				// check for multi channel PCM, stereo downmix if not supported
-				else if (!cRpiSetup::IsAudioFormatSupported(cAudioCodec::ePCM,
-						channels, samplingRate))
-					channels = 2;
-			}
-			else
-				channels = 2;
+				// time of the first staged sample, derived from the end
+				int64_t pts = !m_pts ? OMX_INVALID_PTS : m_pts -
+						(int64_t)(len / m_stageBytesPerSample) * 90000 /
+						m_stageSamplingRate;
 
-			// if the user changes the port, this should change immediately
-			if (newPort != m_port)
-				Flush();
+				OMX_BUFFERHEADERTYPE *buf = m_omx->GetAudioBuffer(pts);
+				if (!buf)
+					break;
 
-			// save new settings to be applied when render is ready
-			if (newPort != m_port || m_codec != newCodec ||
-					m_outChannels != channels || m_samplingRate != samplingRate)
+				SetDiscontinuityFlag(buf);
+
+				if (len > chunk)
+					len = chunk;
+				if (len > buf->nAllocLen)
+					len = buf->nAllocLen / m_stageBytesPerSample *
+							m_stageBytesPerSample;
+
+				memcpy(buf->pBuffer, m_stage + m_stageStart, len);
+				buf->nFilledLen = len;
+				m_stageStart += len;
+
+				// in case of an error, the buffer is recycled by cOmx
+				Submit(buf);
+			}
+			if (m_stageStart == m_stageEnd)
 			{
-				m_configured = false;
-				m_port = newPort;
-				m_codec = newCodec;
-				m_outChannels = channels;
-				m_samplingRate = samplingRate;
-				m_frameSize = frameSize;
+				m_stageStart = 0;
+				m_stageEnd = 0;
 			}
-#ifdef DO_RESAMPLE
-			m_resamplerConfigured = false;
-#endif
 		}
-	}
 
-	bool IsPassthrough(void)
-	{
-		return m_codec != cAudioCodec::ePCM;
+		int stagedTime = CalcStagedTime();
+		if (m_stageFull &&
+				stagedTime <= cRpiSetup::GetAudioLatencyTarget() / 2)
+			m_stageFull = false;
+
+		m_stagedTime = stagedTime;
 	}
 
-	int GetChannels(void)
+#ifdef ENABLE_IEC61937
+	bool IsIec61937(void)
 	{
-		return m_outChannels;
+		return IsPassthrough() && cRpiIec61937::IsSupported(m_codec);
 	}
 
-	bool Ready(void)
+	// writes the pending IEC 61937 burst, returns false if the render has no
+	// buffer left, in which case it's continued with the next call
+	bool WriteBursts(void)
 	{
-		if (!m_configured)
+		while (m_iec.HasBurst())
 		{
-			// wait until render is ready before applying new settings
-			if (m_running && m_omx->GetAudioLatency())
+			OMX_BUFFERHEADERTYPE *buf = m_omx->GetAudioBuffer(m_iec.GetPts());
+			if (!buf)
 				return false;
 
-			ApplyRenderSettings();
+			SetDiscontinuityFlag(buf);
+			buf->nFilledLen = m_iec.Read(buf->pBuffer, buf->nAllocLen);
+
+			// in case of an error, the buffer is recycled by cOmx
+			if (!Submit(buf))
+				return false;
 		}
 		return true;
 	}
-
-private:
-
-	cRpiAudioRender(const cRpiAudioRender&);
-	cRpiAudioRender& operator= (const cRpiAudioRender&);
+#endif
 
 	void ApplyRenderSettings(void)
 	{
 		if (m_running)
 			m_omx->StopAudio();
+		m_started = false;
 
+#ifdef ENABLE_IEC61937
+		m_iec.Reset();
+		if (IsIec61937())
+		{
+			// bursts are sent as stereo PCM, flagged as compressed audio
+			cRpiSetup::SetHDMIChannelMapping(true, 2);
+
+			m_renderSamplingRate = cRpiIec61937::GetSamplingRate(m_codec,
+					m_samplingRate);
+			m_omx->SetupAudioRender(cAudioCodec::ePCM, 2, m_port,
+					m_renderSamplingRate, 0);
+
+			DLOG("set %s audio output format to %s in IEC 61937 bursts, "
+					"%d.%dkHz", cRpiAudioPort::Str(m_port),
+					cAudioCodec::Str(m_codec), m_renderSamplingRate / 1000,
+					(m_renderSamplingRate % 1000) / 100);
+		}
+		else
+#endif
 		if (m_codec != cAudioCodec::eInvalid)
 		{
 			if (m_port == cRpiAudioPort::eHDMI)
@@ -1100,6 +2377,7 @@ private:
 
 			m_omx->SetupAudioRender(m_codec, m_outChannels, m_port,
 					m_samplingRate, m_frameSize);
+			m_renderSamplingRate = m_samplingRate;
 
 			DLOG("set %s audio output format to %dch %s, %d.%dkHz%s",
 					cRpiAudioPort::Str(m_port), m_outChannels,
@@ -1114,10 +2392,49 @@ private:
 #ifdef DO_RESAMPLE
 	void ApplyResamplerSettings(void)
 	{
-		swr_free(&m_resample);
-		m_resample = swr_alloc();
+		m_resample = 0;
+
+		// use a specialized conversion if available
+		m_kernel = cRpiPcmKernel::Get(m_pcmSampleFormat, m_inChannels,
+				m_outChannels);
+		if (m_kernel)
+		{
+			DLOG("using PCM conversion %s", cRpiPcmKernel::Str(m_kernel));
+			m_resamplerConfigured = true;
+			return;
+		}
+
+		// reuse an already initialized context for the same conversion, no
+		// samples are buffered inside, since the sampling rate isn't changed,
+		// otherwise replace the least recently used one
+		tResampler *slot = &m_resamplers[0];
+		for (int i = 0; i < RESAMPLER_CACHE_SIZE; i++)
+		{
+			tResampler &r = m_resamplers[i];
+			if (r.context && r.samplingRate == m_samplingRate &&
+					r.format == m_pcmSampleFormat &&
+					r.inChannels == m_inChannels &&
+					r.outChannels == m_outChannels)
+			{
+				r.lastUse = ++m_resamplerUse;
+				m_resample = r.context;
+				m_resamplerConfigured = true;
+				return;
+			}
+			if (slot->context && (!r.context || r.lastUse < slot->lastUse))
+				slot = &r;
+		}
+
+		swr_free(&slot->context);
+		m_resample = slot->context = swr_alloc();
 		if (m_resample)
 		{
+			slot->samplingRate = m_samplingRate;
+			slot->format = m_pcmSampleFormat;
+			slot->inChannels = m_inChannels;
+			slot->outChannels = m_outChannels;
+			slot->lastUse = ++m_resamplerUse;
+
 			av_opt_set_int(m_resample, "in_sample_rate", m_samplingRate, 0);
 			av_opt_set_int(m_resample, "in_sample_fmt", m_pcmSampleFormat, 0);
 			av_opt_set_int(m_resample, "in_channel_count", m_inChannels, 0);
@@ -1139,6 +2456,7 @@ private:
 #endif
 
 	cOmx		        *m_omx;
+	cRpiAudioStats      *m_stats;
 
 	cRpiAudioPort::ePort m_port;
 	cAudioCodec::eCodec  m_codec;
@@ -1148,14 +2466,45 @@ private:
 	unsigned int         m_frameSize;
 	bool                 m_configured;
 	bool                 m_running;
+	bool                 m_started;
+	bool                 m_discontinuity;
+	unsigned int         m_renderSamplingRate;
+	int                  m_drainTime;
 
 #ifdef DO_RESAMPLE
+	struct tResampler
+	{
+		SwrContext     *context;
+		unsigned int   samplingRate;
+		AVSampleFormat format;
+		unsigned int   inChannels;
+		unsigned int   outChannels;
+		unsigned int   lastUse;
+	};
+
+	tResampler           m_resamplers[RESAMPLER_CACHE_SIZE];
 	SwrContext          *m_resample;
+	cRpiPcmKernel::tConvert m_kernel;
 	bool                 m_resamplerConfigured;
+	unsigned int         m_resamplerUse;
 #endif
 
 	AVSampleFormat       m_pcmSampleFormat;
+	uint8_t             *m_stage;
+	unsigned int         m_stageSize;
+	unsigned int         m_stageStart;
+	unsigned int         m_stageEnd;
+	unsigned int         m_stageBytesPerSample;
+	unsigned int         m_stageSamplingRate;
+	bool                 m_stageFull;
+	std::atomic<int>     m_stagedTime;
+	cOutputThread        m_outputThread;
+	std::atomic<bool>    m_outputThreadEnabled;
+	cMutex               m_mutex;
 	int64_t              m_pts;
+#ifdef ENABLE_IEC61937
+	cRpiIec61937         m_iec;
+#endif
 };
 
 /* ------------------------------------------------------------------------- */
@@ -1165,9 +2514,20 @@ cRpiAudioDecoder::cRpiAudioDecoder(cOmx *omx) :
 	m_passthrough(false),
 	m_reset(false),
 	m_setupChanged(true),
+	m_trackSwitched(false),
+	m_alternatePts(OMX_INVALID_PTS),
 	m_wait(),
+	m_resetMutex(),
+	m_resetDone(),
+	m_omx(omx),
+	m_renderMutex(),
+	m_directPassthrough(false),
+	m_lowPower(false),
+	m_thread(0),
+	m_stats(new cRpiAudioStats()),
 	m_parser(new cParser()),
-	m_render(new cRpiAudioRender(omx))
+	m_alternate(new cParser()),
+	m_render(new cRpiAudioRender(omx, m_stats))
 {
 	memset(m_codecs, 0, sizeof(m_codecs));
 }
@@ -1177,8 +2537,12 @@ cRpiAudioDecoder::~cRpiAudioDecoder()
 	if (Active())
 		Reset();
 
+	ReleaseCodecs(cAudioCodec::eInvalid);
+
 	delete m_render;
+	delete m_alternate;
 	delete m_parser;
+	delete m_stats;
 }
 
 extern int SysLogLevel;
@@ -1189,6 +2553,13 @@ int cRpiAudioDecoder::Init(void)
 	if (ret)
 		return ret;
 
+	ret = m_alternate->Init();
+	if (ret)
+	{
+		m_parser->DeInit();
+		return ret;
+	}
+
 	avcodec_register_all();
 
 	av_log_set_level(
@@ -1196,45 +2567,106 @@ int cRpiAudioDecoder::Init(void)
 			SysLogLevel > 1 ? AV_LOG_INFO : AV_LOG_ERROR);
 	av_log_set_callback(&Log);
 
-	m_codecs[cAudioCodec::ePCM     ].codec = NULL;
-	m_codecs[cAudioCodec::eMPG     ].codec = avcodec_find_decoder(AV_CODEC_ID_MP3);
-	m_codecs[cAudioCodec::eAC3     ].codec = avcodec_find_decoder(AV_CODEC_ID_AC3);
-	m_codecs[cAudioCodec::eEAC3    ].codec = avcodec_find_decoder(AV_CODEC_ID_EAC3);
-	m_codecs[cAudioCodec::eAAC     ].codec = avcodec_find_decoder(AV_CODEC_ID_AAC);
+	// decoders are opened with the first frame needing them and kept open
+	// across DeInit() / Init()
+	cRpiSetup::SetAudioSetupChangedCallback(&OnAudioSetupChanged, this);
+	m_omx->SetAudioBufferEmptiedCallback(&OnAudioBufferEmptied, this);
+	Start();
+
+	return ret;
+}
+
+AVCodecContext* cRpiAudioDecoder::GetContext(cAudioCodec::eCodec codec)
+{
+	Codec &c = m_codecs[codec];
+	if (c.context)
+		return c.context;
+
+	if (!c.codec)
+		switch (codec)
+		{
+		case cAudioCodec::eMPG:
+			c.codec = avcodec_find_decoder(AV_CODEC_ID_MP3);
+			break;
+		case cAudioCodec::eAC3:
+			c.codec = avcodec_find_decoder(AV_CODEC_ID_AC3);
+			break;
+		case cAudioCodec::eEAC3:
+			c.codec = avcodec_find_decoder(AV_CODEC_ID_EAC3);
+			break;
+		case cAudioCodec::eAAC:
+			c.codec = avcodec_find_decoder(AV_CODEC_ID_AAC);
+			break;
 #ifdef ENABLE_AAC_LATM
-	m_codecs[cAudioCodec::eAAC_LATM].codec = avcodec_find_decoder(AV_CODEC_ID_AAC_LATM);
+		case cAudioCodec::eAAC_LATM:
+			c.codec = avcodec_find_decoder(AV_CODEC_ID_AAC_LATM);
+			break;
 #endif
-	m_codecs[cAudioCodec::eDTS     ].codec = avcodec_find_decoder(AV_CODEC_ID_DTS);
+		case cAudioCodec::eDTS:
+			c.codec = avcodec_find_decoder(AV_CODEC_ID_DTS);
+			break;
+		default:
+			break;
+		}
+
+	if (!c.codec)
+	{
+		ELOG("no %s decoder available!", cAudioCodec::Str(codec));
+		return 0;
+	}
 
+	// make room by closing all other decoders if memory is getting short
+	if (IsMemoryLow())
+		ReleaseCodecs(codec);
+
+	cTimeMs openTime;
+	c.context = avcodec_alloc_context3(c.codec);
+	if (!c.context)
+	{
+		ELOG("failed to allocate %s context!", cAudioCodec::Str(codec));
+		return 0;
+	}
+	if (avcodec_open2(c.context, c.codec, NULL) < 0)
+	{
+		ELOG("failed to open %s decoder!", cAudioCodec::Str(codec));
+		avcodec_free_context(&c.context);
+		return 0;
+	}
+	DLOG("opened %s decoder in %llums", cAudioCodec::Str(codec),
+			(unsigned long long)openTime.Elapsed());
+	return c.context;
+}
+
+void cRpiAudioDecoder::ReleaseCodecs(cAudioCodec::eCodec keep)
+{
 	for (int i = 0; i < cAudioCodec::eNumCodecs; i++)
 	{
 		cAudioCodec::eCodec codec = static_cast<cAudioCodec::eCodec>(i);
-		if (m_codecs[codec].codec)
+		if (codec != keep && m_codecs[codec].context)
 		{
-			m_codecs[codec].context = avcodec_alloc_context3(m_codecs[codec].codec);
-			if (!m_codecs[codec].context)
-			{
-				ELOG("failed to allocate %s context!", cAudioCodec::Str(codec));
-				ret = -1;
-				break;
-			}
-			if (avcodec_open2(m_codecs[codec].context, m_codecs[codec].codec, NULL) < 0)
-			{
-				ELOG("failed to open %s decoder!", cAudioCodec::Str(codec));
-				ret = -1;
-				break;
-			}
+			DLOG("closing %s decoder", cAudioCodec::Str(codec));
+			avcodec_free_context(&m_codecs[codec].context);
 		}
 	}
+}
 
-	if (!ret)
+// true if the kernel's estimate of available memory is below the limit
+// up to which unused decoders are kept open
+bool cRpiAudioDecoder::IsMemoryLow(void)
+{
+	bool ret = false;
+	if (FILE *f = fopen("/proc/meminfo", "r"))
 	{
-		cRpiSetup::SetAudioSetupChangedCallback(&OnAudioSetupChanged, this);
-		Start();
+		char line[64];
+		unsigned long available;
+		while (fgets(line, sizeof(line), f))
+			if (sscanf(line, "MemAvailable: %lu kB", &available) == 1)
+			{
+				ret = available < CODEC_MEM_LOW_KB;
+				break;
+			}
+		fclose(f);
 	}
-	else
-		DeInit();
-
 	return ret;
 }
 
@@ -1249,17 +2681,21 @@ int cRpiAudioDecoder::DeInit(void)
 	while (Active())
 		cCondWait::SleepMs(5);
 
+	m_render->SetOutputThread(false);
 	m_render->Flush();
 	cRpiSetup::SetAudioSetupChangedCallback(0);
+	m_omx->SetAudioBufferEmptiedCallback(0, 0);
 
+	// keep decoders for the next Init(), unless memory is getting short
 	for (int i = 0; i < cAudioCodec::eNumCodecs; i++)
-	{
-		cAudioCodec::eCodec codec = static_cast<cAudioCodec::eCodec>(i);
-		if (m_codecs[codec].codec)
-			avcodec_close(m_codecs[codec].context);
-	}
+		if (m_codecs[i].context)
+			avcodec_flush_buffers(m_codecs[i].context);
+
+	if (IsMemoryLow())
+		ReleaseCodecs(cAudioCodec::eInvalid);
 
 	av_log_set_callback(&av_log_default_callback);
+	m_alternate->DeInit();
 	m_parser->DeInit();
 
 	Unlock();
@@ -1271,38 +2707,218 @@ bool cRpiAudioDecoder::WriteData(const unsigned char *buf, unsigned int length,
 {
 	Lock();
 
-	bool ret = m_parser->Append(buf, pts, length);
+	// while the decoder thread waits in pass-through mode, complete frames
+	// are copied straight into OMX buffers instead of going through the parser
+	if (m_directPassthrough)
+	{
+		if (unsigned int written = WriteDirect(buf, length, pts))
+		{
+			buf += written;
+			length -= written;
+			pts = OMX_INVALID_PTS;
+		}
+	}
+
+	bool ret = true;
+	if (length)
+	{
+		ret = m_parser->Append(buf, pts, length);
+		if (ret)
+		{
+			m_stats->Count(cRpiAudioStats::eInputWakeup);
+			m_wait.Signal();
+		}
+	}
+
+	Unlock();
+	return ret;
+}
+
+unsigned int cRpiAudioDecoder::WriteDirect(const unsigned char *buf,
+		unsigned int length, int64_t pts)
+{
+	unsigned int written = 0;
+	m_renderMutex.Lock();
+
+	// re-check, since the thread may have been woken up in the meantime
+	if (m_directPassthrough && !m_reset && !m_setupChanged &&
+			!m_trackSwitched && m_parser->IsEmpty())
+	{
+		while (written < length)
+		{
+			uint8_t *p = const_cast<uint8_t*>(buf + written);
+			cAudioCodec::eCodec codec = cAudioCodec::eInvalid;
+			unsigned int channels = 0, samplingRate = 0, samples = 0;
+
+			unsigned int frameSize = cParser::CompleteFrame(p,
+					length - written, codec, channels, samplingRate, samples);
+			if (!frameSize ||
+					!m_render->AcceptsPassthrough(codec, channels, samplingRate))
+				break;
+
+			// a partially written frame is dropped by the parser, just as it
+			// would have been after being written from there
+			int64_t gap = 0;
+			int64_t framePts = m_parser->DirectFramePts(pts, samplingRate, gap);
+			if (llabs(gap) > PCM_PTS_TOLERANCE)
+				m_render->SetDiscontinuity();
+
+			int len = m_render->WriteSamples(&p, frameSize, framePts);
+			if (len <= 0)
+				break;
+
+			m_parser->DirectFrameWritten(samples);
+			written += len;
+			pts = OMX_INVALID_PTS;
+			if ((unsigned int)len < frameSize)
+				break;
+
+			m_stats->Count(cRpiAudioStats::eDirectFrame);
+		}
+	}
+	m_renderMutex.Unlock();
+	return written;
+}
+
+bool cRpiAudioDecoder::WriteAlternateData(const unsigned char *buf,
+		unsigned int length, int64_t pts)
+{
+	Lock();
+
+	if (pts != OMX_INVALID_PTS)
+		m_alternatePts = pts;
+
+	// drop frames which would be played long before the appended data, or
+	// make room for it
+	cParser::Frame next;
+	while (m_alternate->NextFrame(next) && (length > m_alternate->GetFreeSpace()
+			|| m_alternate->IsPtsQueueFull()
+			|| (next.pts != OMX_INVALID_PTS && m_alternatePts != OMX_INVALID_PTS
+			&& m_alternatePts - next.pts > ALTERNATE_TRACK_HOLD)))
+		m_alternate->Shrink(next.size);
+
+	bool ret = m_alternate->Append(buf, pts, length);
+	if (!ret)
+		m_alternate->Reset();
+
+	Unlock();
+	return ret;
+}
+
+bool cRpiAudioDecoder::SwitchTrack(void)
+{
+	Lock();
+	m_renderMutex.Lock();
+
+	// skip what has been due before now
+	int64_t stc = m_omx->IsClockRunning() ? m_omx->GetSTC() : OMX_INVALID_PTS;
+	cParser::Frame next;
+	while (stc != OMX_INVALID_PTS && m_alternate->NextFrame(next) &&
+			next.pts != OMX_INVALID_PTS && next.pts < stc)
+		m_alternate->Shrink(next.size);
+
+	// keep the current track as alternate, the caller may switch back
+	bool ret = m_alternate->NextFrame(next);
 	if (ret)
+	{
+		cParser *parser = m_parser;
+		m_parser = m_alternate;
+		m_alternate = parser;
+		m_alternatePts = OMX_INVALID_PTS;
+
+		m_trackSwitched = true;
 		m_wait.Signal();
+		DLOG("switched to pre-parsed %s audio track",
+				cAudioCodec::Str(next.codec));
+	}
 
+	m_renderMutex.Unlock();
 	Unlock();
 	return ret;
 }
 
+void cRpiAudioDecoder::ResetAlternate(void)
+{
+	Lock();
+	m_alternate->Reset();
+	m_alternatePts = OMX_INVALID_PTS;
+	Unlock();
+}
+
 void cRpiAudioDecoder::Reset(void)
 {
 	Lock();
+	m_alternate->Reset();
+	m_alternatePts = OMX_INVALID_PTS;
+	m_resetMutex.Lock();
 	m_reset = true;
 	m_wait.Signal();
 	while (m_reset && Active())
-		cCondWait::SleepMs(5);
+		m_resetDone.Wait(m_resetMutex);
+	m_resetMutex.Unlock();
 	Unlock();
 }
 
 bool cRpiAudioDecoder::Poll(void)
 {
-	return m_parser->GetFreeSpace() > KILOBYTE(16);
+	return m_parser->GetFreeSpace() > KILOBYTE(16) &&
+			!m_parser->IsPtsQueueFull();
+}
+
+cString cRpiAudioDecoder::GetStats(void)
+{
+	return m_stats->Dump(GetCpuTime());
+}
+
+void cRpiAudioDecoder::ResetStats(void)
+{
+	m_stats->Reset(GetCpuTime());
+}
+
+int64_t cRpiAudioDecoder::GetCpuTime(void)
+{
+	clockid_t clock;
+	struct timespec ts;
+
+	if (!Active() || pthread_getcpuclockid(m_thread, &clock) ||
+			clock_gettime(clock, &ts))
+		return 0;
+
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int cRpiAudioDecoder::GetStagedTime(void)
+{
+	return m_render->GetStagedTime();
 }
 
 void cRpiAudioDecoder::HandleAudioSetupChanged()
 {
 	DBG("HandleAudioSetupChanged()");
 	m_setupChanged = true;
+	m_wait.Signal();
+}
+
+void cRpiAudioDecoder::SignalResetDone(void)
+{
+	m_resetMutex.Lock();
+	m_reset = false;
+	m_resetDone.Broadcast();
+	m_resetMutex.Unlock();
+}
+
+void cRpiAudioDecoder::HandleAudioBufferEmptied()
+{
+	m_stats->Count(cRpiAudioStats::eRenderWakeup);
+	m_render->SignalOutput();
+	m_wait.Signal();
 }
 
 void cRpiAudioDecoder::Action(void)
 {
-	SetPriority(-15);
+	bool lowPower = m_lowPower;
+	SetPriority(lowPower ? 0 : -15);
+	m_thread = pthread_self();
 	DLOG("cAudioDecoder() thread started");
 
 	unsigned int channels = 0;
@@ -1317,9 +2933,14 @@ void cRpiAudioDecoder::Action(void)
 	if (!frame)
 	{
 		ELOG("failed to allocate audio frame!");
+		SignalResetDone();
 		return;
 	}
 
+	// the render is only used by this thread, except while it's waiting and
+	// WriteData() passes complete frames through
+	m_renderMutex.Lock();
+
 	while (Running())
 	{
 		if (m_reset)
@@ -1327,40 +2948,80 @@ void cRpiAudioDecoder::Action(void)
 			m_parser->Reset();
 			m_render->Flush();
 			av_frame_unref(frame);
-			m_reset = false;
+			SignalResetDone();
+		}
+
+		// the priority can only be changed by the thread itself
+		if (lowPower != m_lowPower)
+		{
+			lowPower = m_lowPower;
+			SetPriority(lowPower ? 0 : -15);
+		}
+
+		// submitting decoded audio on another core only pays off if
+		// decoding is busy, so not for audio-only playback
+		m_render->SetOutputThread(
+				cRpiSetup::IsAudioOutputThread() && !lowPower);
+
+		// drop whatever is left of the previous track instead of waiting
+		// for the render to drain before it's reconfigured
+		if (m_trackSwitched)
+		{
+			m_trackSwitched = false;
+			m_render->Flush();
+			av_frame_unref(frame);
+			if (codec != cAudioCodec::eInvalid && m_codecs[codec].context)
+				avcodec_flush_buffers(m_codecs[codec].context);
+			m_setupChanged = true;
 		}
 
+		cParser::Frame next;
+		bool available = m_parser->NextFrame(next);
+
+		if (next.parseTime)
+			m_stats->Add(cRpiAudioStats::eParse, next.parseTime);
+
+		if (next.crcErrors)
+			m_stats->Count(cRpiAudioStats::eCrcError, next.crcErrors);
+
 		// test for codec change if there is data in parser and no left over
-		if (!m_parser->Empty() && !frame->nb_samples)
-			m_setupChanged |= codec != m_parser->GetCodec() ||
-				channels != m_parser->GetChannels() ||
-				samplingRate != m_parser->GetSamplingRate();
+		if (available && !frame->nb_samples)
+			m_setupChanged |= codec != next.codec ||
+				channels != next.channels ||
+				samplingRate != next.samplingRate;
 
 		// if necessary, set up audio codec
-		if (!m_parser->Empty() && m_setupChanged)
+		if (available && m_setupChanged)
 		{
-			if (codec != m_parser->GetCodec() && codec != cAudioCodec::eInvalid)
+			if (codec != next.codec && codec != cAudioCodec::eInvalid &&
+					m_codecs[codec].context)
 				avcodec_flush_buffers(m_codecs[codec].context);
 
-			codec = m_parser->GetCodec();
-			channels = m_parser->GetChannels();
-			samplingRate = m_parser->GetSamplingRate();
+			codec = next.codec;
+			channels = next.channels;
+			samplingRate = next.samplingRate;
 
 			// validate channel layout and apply new audio parameters
 			if (AV_CH_LAYOUT(channels))
 			{
 				m_setupChanged = false;
-				m_render->SetCodec(codec, channels, samplingRate,
-						m_parser->GetFrameSize());
+				m_render->SetCodec(codec, channels, samplingRate, next.size);
 
+				// pass-through doesn't need a decoder
+				AVCodecContext *ctx = m_render->IsPassthrough() ? 0 :
+						GetContext(codec);
 #ifndef DO_RESAMPLE
+				if (ctx)
+				{
 #if FF_API_REQUEST_CHANNELS
-				// if there's no libswresample, let decoder do the down mix
-				m_codecs[codec].context->request_channels =
-						m_render->GetChannels();
+					// if there's no libswresample, let decoder do the down mix
+					ctx->request_channels = m_render->GetChannels();
 #endif
-				m_codecs[codec].context->request_channel_layout =
-						AV_CH_LAYOUT(m_render->GetChannels());
+					ctx->request_channel_layout =
+							AV_CH_LAYOUT(m_render->GetChannels());
+				}
+#else
+				(void)ctx;
 #endif
 			}
 			m_reset = m_setupChanged;
@@ -1368,14 +3029,22 @@ void cRpiAudioDecoder::Action(void)
 		}
 
 		// if there's audio data available...
-		if (!m_parser->Empty())
+		if (available)
 		{
+			// decoded audio gets gaps filled by the render, which tracks
+			// the time of its samples itself
+			if (llabs(next.gap) > PCM_PTS_TOLERANCE &&
+					m_render->IsPassthrough())
+				m_render->SetDiscontinuity();
+
 			// ... either pass through if render is ready
 			if (m_render->IsPassthrough())
 			{
-				if (int len = m_render->WriteSamples(&m_parser->Packet()->data,
-						m_parser->Packet()->size, m_parser->GetPts()))
+				if (int len = m_render->WriteSamples(&next.data, next.size,
+						next.pts))
 				{
+					m_stats->Add(cRpiAudioStats::eWait,
+							cTimeUs::Now() - next.time);
 					m_parser->Shrink(len);
 					continue;
 				}
@@ -1383,20 +3052,26 @@ void cRpiAudioDecoder::Action(void)
 			// ... or decode if there's no leftover
 			else if (!frame->nb_samples)
 			{
+				int64_t start = cTimeUs::Now();
 #if LIBAVCODEC_VERSION_MAJOR < 58
 				int gotFrame = 0;
-				int len = avcodec_decode_audio4(m_codecs[codec].context,
+				int len = !m_codecs[codec].context ? -1 :
+						avcodec_decode_audio4(m_codecs[codec].context,
 						frame, &gotFrame, m_parser->Packet());
 
 				if (len > 0 && gotFrame)
 				{
-					frame->pts = m_parser->GetPts();
+					m_stats->Add(cRpiAudioStats::eDecode,
+							cTimeUs::Now() - start);
+					m_stats->Add(cRpiAudioStats::eWait, start - next.time);
+					frame->pts = next.pts;
 					m_parser->Shrink(len);
 				}
 				else
 				{
+					// drop this frame only, the parser is still in sync
 					ELOG("failed to decode audio frame!");
-					m_parser->Reset();
+					m_parser->Shrink(next.size);
 					av_frame_unref(frame);
 					continue;
 				}
@@ -1408,15 +3083,25 @@ void cRpiAudioDecoder::Action(void)
 				    (!(pending_len = packet->size) || !ctx ||
 				     avcodec_send_packet(ctx, packet) < 0))
 				{
-					do_sleep = true;
-					goto done_with_packet;
+					// drop this frame only, the parser is still in sync and
+					// may hold further frames, so don't wait for new data
+					ELOG("failed to decode audio frame!");
+					m_parser->Shrink(next.size);
+					pending_len = 0;
+					continue;
 				}
 				else
-					pending_pts = m_parser->GetPts();
+				{
+					pending_pts = next.pts;
+					m_stats->Add(cRpiAudioStats::eWait, start - next.time);
+				}
 
 				while (avcodec_receive_frame(ctx, frame) >= 0 &&
 				       frame->nb_samples)
 				{
+					// decoding time of the first frame includes sending
+					m_stats->Add(cRpiAudioStats::eDecode,
+							cTimeUs::Now() - start);
 					if (!m_render->WriteSamples(frame->extended_data,
 								    frame->nb_samples,
 								    frame->pts =
@@ -1427,8 +3112,8 @@ void cRpiAudioDecoder::Action(void)
 						do_sleep = true;
 						break;
 					}
+					start = cTimeUs::Now();
 				}
-			done_with_packet:
 				m_parser->Shrink(pending_len);
 				pending_len = 0;
 
@@ -1444,9 +3129,25 @@ void cRpiAudioDecoder::Action(void)
 					   (AVSampleFormat)frame->format))
 			av_frame_unref(frame);
 		else
-			// nothing to be done...
-			m_wait.Wait(50);
+		{
+			// nothing to be done until new data arrives or the render has
+			// emptied a buffer, unless it has to drain before reconfiguration
+			m_render->Idle(!frame->nb_samples);
+			m_directPassthrough = !frame->nb_samples && !m_reset &&
+					m_render->IsPassthrough() && m_parser->IsEmpty();
+
+			int timeout = m_render->GetDrainTime();
+			m_renderMutex.Unlock();
+			m_wait.Wait(timeout);
+			m_renderMutex.Lock();
+
+			m_directPassthrough = false;
+		}
 	}
+	m_renderMutex.Unlock();
+
+	// release a pending Reset(), in case the thread has been cancelled
+	SignalResetDone();
 
 	av_frame_free(&frame);
 	DLOG("cAudioDecoder() thread ended");
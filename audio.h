@@ -23,6 +23,7 @@
 #include "omx.h"
 
 class cRpiAudioRender;
+class cRpiAudioStats;
 
 class cRpiAudioDecoder : public cThread
 {
@@ -41,6 +42,24 @@ public:
 	virtual bool Poll(void);
 	virtual void Reset(void);
 
+	// an alternate audio track is parsed in the background, so switching to
+	// it doesn't need to wait for the current track's data to be played
+	bool WriteAlternateData(const unsigned char *buf, unsigned int length,
+			int64_t pts);
+	bool SwitchTrack(void);
+	void ResetAlternate(void);
+
+	int64_t GetCpuTime(void);
+
+	// duration of decoded audio in ms staged ahead of the render
+	int GetStagedTime(void);
+
+	// lowers the priority of the decoder thread, e.g. for radio
+	void SetLowPower(bool lowPower) { m_lowPower = lowPower; }
+
+	cString GetStats(void);
+	void ResetStats(void);
+
 protected:
 
 	virtual void Action(void);
@@ -50,6 +69,19 @@ protected:
 
 	void HandleAudioSetupChanged();
 
+	static void OnAudioBufferEmptied(void *data)
+		{ (static_cast <cRpiAudioDecoder*> (data))->HandleAudioBufferEmptied(); }
+
+	void HandleAudioBufferEmptied();
+	void SignalResetDone(void);
+
+	class AVCodecContext* GetContext(cAudioCodec::eCodec codec);
+	void ReleaseCodecs(cAudioCodec::eCodec keep);
+	static bool IsMemoryLow(void);
+
+	unsigned int WriteDirect(const unsigned char *buf, unsigned int length,
+			int64_t pts);
+
 	static void Log(void* ptr, int level, const char* fmt, va_list vl);
 
 	struct Codec
@@ -66,9 +98,20 @@ private:
 	bool		  	m_passthrough;
 	bool		  	m_reset;
 	bool		  	m_setupChanged;
+	bool		  	m_trackSwitched;
+	int64_t		  	m_alternatePts;
 
 	cCondWait	 	m_wait;
+	cMutex		 	m_resetMutex;
+	cCondVar	 	m_resetDone;
+	cOmx		 	*m_omx;
+	cMutex		 	m_renderMutex;
+	std::atomic<bool> m_directPassthrough;
+	std::atomic<bool> m_lowPower;
+	pthread_t	 	m_thread;
+	cRpiAudioStats	*m_stats;
 	cParser		 	*m_parser;
+	cParser		 	*m_alternate;
 	cRpiAudioRender	*m_render;
 };
 
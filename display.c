@@ -21,6 +21,7 @@
 #include "ovgosd.h"
 #include "tools.h"
 #include "setup.h"
+#include "trace.h"
 
 #include <vdr/tools.h>
 
@@ -30,6 +31,7 @@ extern "C" {
 }
 
 #include <bcm_host.h>
+#include <string.h>
 
 cRpiDisplay* cRpiDisplay::s_instance = 0;
 
@@ -191,6 +193,15 @@ int cRpiDisplay::GetId(void)
 	return false;
 }
 
+bool cRpiDisplay::IsAudioFormatSupported(cAudioCodec::eCodec codec,
+		int channels, int samplingRate)
+{
+	cRpiDisplay* instance = GetInstance();
+	return instance ?
+			instance->IsSinkAudioFormatSupported(codec, channels, samplingRate) :
+			false;
+}
+
 int cRpiDisplay::Snapshot(unsigned char* frame, int width, int height)
 {
 	cRpiDisplay* instance = GetInstance();
@@ -363,8 +374,11 @@ int cRpiDisplay::Update(const cVideoFrameFormat *frameFormat)
 	if (newWidth != m_width || newHeight != m_height ||
 			newFrameRate != m_frameRate || newInterlaced != m_interlaced ||
 			newAspectRatio != m_aspectRatio)
+	{
+		cRpiTrace::Add(cRpiTrace::eDisplayUpdate, newHeight);
 		return SetMode(newWidth, newHeight, newFrameRate, newAspectRatio,
 				newInterlaced ? frameFormat->scanMode : cScanMode::eProgressive);
+	}
 
 	return 0;
 }
@@ -392,6 +406,47 @@ public:
 	int nModes;
 };
 
+class cRpiHDMIDisplay::cEdidReader : public cThread
+{
+public:
+
+	cEdidReader(cRpiHDMIDisplay *display) :
+		cThread("edid reader"), m_display(display)
+	{
+		Start();
+	}
+
+	virtual ~cEdidReader()
+	{
+		Cancel(-1);
+		m_wait.Signal();
+		while (Active())
+			cCondWait::SleepMs(2);
+	}
+
+	void Refresh(void)
+	{
+		m_wait.Signal();
+	}
+
+protected:
+
+	virtual void Action(void)
+	{
+		while (Running())
+		{
+			m_wait.Wait(0);
+			if (Running())
+				m_display->ReadEdid();
+		}
+	}
+
+private:
+
+	cRpiHDMIDisplay *m_display;
+	cCondWait m_wait;
+};
+
 cRpiHDMIDisplay::cRpiHDMIDisplay(int id, int width, int height, int frameRate,
 		int aspectRatio, bool interlaced, int group, int mode) :
 	cRpiDisplay(id, width, height, frameRate, aspectRatio, interlaced, false),
@@ -400,10 +455,9 @@ cRpiHDMIDisplay::cRpiHDMIDisplay(int id, int width, int height, int frameRate,
 	m_mode(mode),
 	m_startGroup(group),
 	m_startMode(mode),
-	m_modified(false)
+	m_modified(false),
+	m_edidReader(0)
 {
-	vc_tv_register_callback(TvServiceCallback, 0);
-
 	m_modes->nModes = vc_tv_hdmi_get_supported_modes_new(HDMI_RES_GROUP_CEA,
 			m_modes->modes, HDMI_MAX_MODES, NULL, NULL);
 
@@ -445,11 +499,21 @@ cRpiHDMIDisplay::cRpiHDMIDisplay(int id, int width, int height, int frameRate,
 	else
 		ELOG("failed to read HDMI EDID information!");
 
+	// the sink's capabilities are unknown until the EDID reader has queried
+	// them, which takes a while and shouldn't delay the plugin's start
+	memset(m_audioChannels, 0, sizeof(m_audioChannels));
+	for (int i = 0; i < 2; i++)
+		m_latency[i][0] = m_latency[i][1] = -1;
+
+	m_edidReader = new cRpiHDMIDisplay::cEdidReader(this);
+	m_edidReader->Refresh();
+	vc_tv_register_callback(TvServiceCallback, this);
 }
 
 cRpiHDMIDisplay::~cRpiHDMIDisplay()
 {
 	vc_tv_unregister_callback(TvServiceCallback);
+	delete m_edidReader;
 
 	// if mode has been changed, set back to previous state
 	if (m_modified)
@@ -492,6 +556,11 @@ int cRpiHDMIDisplay::SetMode(int width, int height, int frameRate,
 		m_aspectRatio = m_modes->modes[mode].aspect_ratio;
 		m_interlaced = m_modes->modes[mode].scan_mode;
 
+		// the sink's latency depends on the scan mode
+		m_edidMutex.Lock();
+		UpdateSinkLatency();
+		m_edidMutex.Unlock();
+
 		DLOG("setting HDMI mode to %dx%d@%2d%s (%s)", m_width, m_height,
 				m_frameRate, m_interlaced ? "i" : "p",
 				AspectRatioStr(m_aspectRatio));
@@ -521,6 +590,7 @@ int cRpiHDMIDisplay::SetMode(int group, int mode)
 			ELOG("failed to set HDMI mode!");
 		else
 		{
+			cRpiTrace::Add(cRpiTrace::eHdmiModeSet, mode);
 			m_group = group;
 			m_mode = mode;
 			m_modified = true;
@@ -529,9 +599,142 @@ int cRpiHDMIDisplay::SetMode(int group, int mode)
 	return ret;
 }
 
+// to be called with m_edidMutex locked
+void cRpiHDMIDisplay::UpdateSinkLatency(void)
+{
+	cRpiSetup::SetSinkLatency(m_latency[m_interlaced ? 1 : 0][0],
+			m_latency[m_interlaced ? 1 : 0][1]);
+}
+
+bool cRpiHDMIDisplay::IsSinkAudioFormatSupported(cAudioCodec::eCodec codec,
+		int channels, int samplingRate)
+{
+	if (codec >= cAudioCodec::eNumCodecs)
+		return false;
+
+	// other rates have always been checked as 48kHz
+	int rate =
+			samplingRate ==  32000 ? 0 :
+			samplingRate ==  44100 ? 1 :
+			samplingRate ==  88200 ? 3 :
+			samplingRate ==  96000 ? 4 :
+			samplingRate == 176400 ? 5 :
+			samplingRate == 192000 ? 6 : 2;
+
+	m_edidMutex.Lock();
+	bool ret = channels > 0 && m_audioChannels[codec][rate] >= channels;
+	m_edidMutex.Unlock();
+	return ret;
+}
+
+// reads the audio capabilities and the latency of the sink, to be called
+// from the EDID reader thread only
+void cRpiHDMIDisplay::ReadEdid(void)
+{
+	// the firmware's view of the sink is used for the audio capabilities,
+	// so settings like hdmi_force_edid_audio are taken into account
+	static const EDID_AudioSampleRate rates[7] = {
+		EDID_AudioSampleRate_e32KHz,  EDID_AudioSampleRate_e44KHz,
+		EDID_AudioSampleRate_e48KHz,  EDID_AudioSampleRate_e88KHz,
+		EDID_AudioSampleRate_e96KHz,  EDID_AudioSampleRate_e176KHz,
+		EDID_AudioSampleRate_e192KHz
+	};
+
+	uint8_t audioChannels[cAudioCodec::eNumCodecs][7];
+	memset(audioChannels, 0, sizeof(audioChannels));
+
+	for (int codec = 0; codec < cAudioCodec::eNumCodecs; codec++)
+	{
+		EDID_AudioFormat format =
+				codec == cAudioCodec::eMPG  ? EDID_AudioFormat_eMPEG1 :
+				codec == cAudioCodec::eAC3  ? EDID_AudioFormat_eAC3   :
+				codec == cAudioCodec::eEAC3 ? EDID_AudioFormat_eEAC3  :
+				codec == cAudioCodec::eAAC  ? EDID_AudioFormat_eAAC   :
+				codec == cAudioCodec::eDTS  ? EDID_AudioFormat_eDTS   :
+						EDID_AudioFormat_ePCM;
+
+		// a format the sink doesn't support at 48kHz stereo is skipped
+		// completely, so unsupported formats don't cost a query per rate
+		// and channel count. PCM support is checked for 16 bit samples
+		if (vc_tv_hdmi_audio_supported(format, 2, EDID_AudioSampleRate_e48KHz,
+				EDID_AudioSampleSize_16bit) != 0)
+			continue;
+
+		for (int rate = 0; rate < 7; rate++)
+			for (int ch = 8; ch > 0 && !audioChannels[codec][rate]; ch--)
+				if (vc_tv_hdmi_audio_supported(format, ch, rates[rate],
+						EDID_AudioSampleSize_16bit) == 0)
+					audioChannels[codec][rate] = ch;
+
+		if (audioChannels[codec][2])
+			DLOG("HDMI sink supports %s with up to %dch at 48kHz",
+					cAudioCodec::Str((cAudioCodec::eCodec)codec),
+					audioChannels[codec][2]);
+	}
+
+	int latency[2][2];
+	for (int i = 0; i < 2; i++)
+		latency[i][0] = latency[i][1] = -1;
+
+	// latency is coded as (ms / 2 + 1), 0 means unknown, 255 no output
+	#define LATENCY_MS(x) ((x) && (x) != 255 ? ((x) - 1) * 2 : -1)
+
+	uint8_t edid[128];
+	int extensions = vc_tv_hdmi_ddc_read(0, sizeof(edid), edid) ==
+			sizeof(edid) ? edid[126] : 0;
+
+	for (int ext = 1; ext <= extensions; ext++)
+	{
+		// look for the HDMI vendor specific data block in CEA-861 extensions
+		if (vc_tv_hdmi_ddc_read(ext * sizeof(edid), sizeof(edid), edid) !=
+				sizeof(edid))
+			break;
+
+		if (edid[0] != 0x02 || edid[2] < 4)
+			continue;
+
+		for (int i = 4; i < edid[2] && i < 128; i += (edid[i] & 0x1f) + 1)
+		{
+			const uint8_t *vsdb = edid + i;
+			int length = vsdb[0] & 0x1f;
+			if (vsdb[0] >> 5 != 3 || length < 8 || i + length >= 128 ||
+					vsdb[1] != 0x03 || vsdb[2] != 0x0c || vsdb[3] != 0x00)
+				continue;
+
+			if ((vsdb[8] & 0x80) && length >= 10)
+			{
+				latency[0][0] = latency[1][0] = LATENCY_MS(vsdb[9]);
+				latency[0][1] = latency[1][1] = LATENCY_MS(vsdb[10]);
+			}
+			if ((vsdb[8] & 0x40) && length >= 12)
+			{
+				latency[1][0] = LATENCY_MS(vsdb[11]);
+				latency[1][1] = LATENCY_MS(vsdb[12]);
+			}
+		}
+	}
+	#undef LATENCY_MS
+
+	DLOG("HDMI sink latency: video %dms/%dms, audio %dms/%dms "
+			"(progressive/interlaced)", latency[0][0], latency[1][0],
+			latency[0][1], latency[1][1]);
+
+	// lookups only wait for the copy, not for the TV service
+	m_edidMutex.Lock();
+	memcpy(m_audioChannels, audioChannels, sizeof(m_audioChannels));
+	memcpy(m_latency, latency, sizeof(m_latency));
+	UpdateSinkLatency();
+	m_edidMutex.Unlock();
+}
+
 void cRpiHDMIDisplay::TvServiceCallback(void *data, unsigned int reason,
 		unsigned int param1, unsigned int param2)
 {
+	cRpiTrace::Add(cRpiTrace::eHdmiEvent, reason);
+
+	// a new sink may have been connected, let its EDID be read again
+	if (data && (reason & (VC_HDMI_ATTACHED | VC_HDMI_HDMI | VC_HDMI_DVI)))
+		(static_cast <cRpiHDMIDisplay*> (data))->m_edidReader->Refresh();
 	if (reason & VC_HDMI_DVI + VC_HDMI_HDMI)
 		cRpiOsdProvider::ResetOsd();
 }
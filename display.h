@@ -22,6 +22,8 @@
 
 #include "tools.h"
 
+#include <vdr/thread.h>
+
 class cRpiDisplay
 {
 
@@ -38,6 +40,11 @@ public:
 
 	static int GetId(void);
 
+	// true if the sink supports the audio format, as reported by the
+	// firmware after the last hotplug event
+	static bool IsAudioFormatSupported(cAudioCodec::eCodec codec,
+			int channels, int samplingRate);
+
 	static int Snapshot(unsigned char* frame, int width, int height);
 
 	static int SetVideoFormat(const cVideoFrameFormat *frameFormat);
@@ -55,6 +62,11 @@ protected:
 		return 0;
 	}
 
+	virtual bool IsSinkAudioFormatSupported(cAudioCodec::eCodec codec,
+			int channels, int samplingRate) {
+		return false;
+	}
+
 	static int SetHvsSyncUpdate(cScanMode::eMode scanMode);
 
 	static void GetModeFormat(const cVideoFrameFormat *format,
@@ -94,6 +106,11 @@ private:
 			cScanMode::eMode scanMode);
 	int SetMode(int group, int mode);
 
+	virtual bool IsSinkAudioFormatSupported(cAudioCodec::eCodec codec,
+			int channels, int samplingRate);
+	void ReadEdid(void);
+	void UpdateSinkLatency(void);
+
 	static void TvServiceCallback(void *data, unsigned int reason,
 			unsigned int param1, unsigned int param2);
 
@@ -106,6 +123,19 @@ private:
 	int m_startGroup;
 	int m_startMode;
 	bool m_modified;
+
+	// progressive and interlaced video and audio latency from the EDID
+	int m_latency[2][2];
+
+	// maximum number of channels per audio codec and sampling rate of 32,
+	// 44.1, 48, 88.2, 96, 176.4 and 192kHz
+	uint8_t m_audioChannels[cAudioCodec::eNumCodecs][7];
+
+	// the EDID is read again by a separate thread after hotplug events, since
+	// TV service functions shouldn't be called from the callback
+	class cEdidReader;
+	cEdidReader *m_edidReader;
+	cMutex m_edidMutex;
 };
 
 class cRpiDefaultDisplay : public cRpiDisplay
@@ -0,0 +1,273 @@
+/*
+ * rpihddevice - VDR HD output device for Raspberry Pi
+ * Copyright (C) 2014, 2015, 2016 Thomas Reufer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef IEC61937_H
+#define IEC61937_H
+
+#include "tools.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// burst preamble and maximum burst size, which is the repetition period of
+// E-AC-3, according to IEC 61937
+#define IEC61937_PREAMBLE 8
+#define IEC61937_MAX_BURST 24576
+
+// packs compressed audio frames into IEC 61937 data bursts, which are sent to
+// the render as stereo 16 bit PCM, so the firmware doesn't need to know about
+// the codec. Each burst is padded to the repetition period of its data type.
+
+class cRpiIec61937
+{
+
+public:
+
+	cRpiIec61937()
+	{
+		Reset();
+	}
+
+	static bool IsSupported(cAudioCodec::eCodec codec)
+	{
+		return	codec == cAudioCodec::eMPG  || codec == cAudioCodec::eAC3 ||
+				codec == cAudioCodec::eEAC3 || codec == cAudioCodec::eDTS;
+	}
+
+	// sampling rate of the PCM stream carrying the bursts
+	static unsigned int GetSamplingRate(cAudioCodec::eCodec codec,
+			unsigned int samplingRate)
+	{
+		return samplingRate * RateFactor(codec, samplingRate);
+	}
+
+	void Reset(void)
+	{
+		m_size = 0;
+		m_samples = 0;
+		m_pts = OMX_INVALID_PTS;
+		m_burstSize = 0;
+		m_burstRead = 0;
+		m_burstPts = OMX_INVALID_PTS;
+	}
+
+	///
+	///	Adds a frame to the current burst. Returns false if the frame hasn't
+	///	been added, since a complete burst has to be read first. Frames which
+	///	don't fit into a burst are dropped.
+	///
+	bool Add(cAudioCodec::eCodec codec, const uint8_t *p, unsigned int size,
+			int64_t pts)
+	{
+		if (HasBurst())
+			return false;
+
+		if (codec == cAudioCodec::eEAC3)
+		{
+			// frames are collected until they cover six audio blocks, the
+			// burst is completed right away then, so it's not held back until
+			// the next frame. Dependent substreams belong to their preceding
+			// frame and are dropped if its burst has already been completed
+			bool independent = (p[2] >> 6) != 1 && !(p[2] & 0x38);
+			if (!m_size && !independent)
+				return true;
+
+			if (independent)
+				m_samples += FrameSamples(codec, p);
+		}
+		else
+			m_samples = FrameSamples(codec, p);
+
+		if (!m_samples || IEC61937_PREAMBLE + m_size + size > IEC61937_MAX_BURST)
+		{
+			ELOG("failed to pack %s audio frame into IEC 61937 burst!",
+					cAudioCodec::Str(codec));
+			m_size = 0;
+			m_samples = 0;
+			return true;
+		}
+
+		if (!m_size)
+			m_pts = pts;
+
+		Append(p, size);
+
+		switch (codec)
+		{
+		case cAudioCodec::eMPG:
+		{
+			bool lsf = !(p[1] & 0x08);
+			int layer = 4 - ((p[1] >> 1) & 0x03);
+			Complete(layer == 1 ? (lsf ? 0x08 : 0x04) :
+					layer == 2 ? (lsf ? 0x09 : 0x05) : (lsf ? 0x0A : 0x05),
+					0, m_samples * (lsf ? 2 : 1) * 4, false);
+			break;
+		}
+		case cAudioCodec::eAC3:
+			// bit stream mode as data type dependent information
+			Complete(0x01, p[5] & 0x07, m_samples * 4, false);
+			break;
+
+		case cAudioCodec::eEAC3:
+			if (m_samples >= 6 * 256)
+				Complete(0x15, 0, IEC61937_MAX_BURST, true);
+			break;
+
+		case cAudioCodec::eDTS:
+			Complete(m_samples == 512 ? 0x0B : m_samples == 1024 ? 0x0C : 0x0D,
+					0, m_samples * 4, false);
+			break;
+
+		default:
+			break;
+		}
+		return true;
+	}
+
+	bool HasBurst(void)
+	{
+		return m_burstRead < m_burstSize;
+	}
+
+	// PTS of the next chunk to be read, only the first one of a burst has one
+	int64_t GetPts(void)
+	{
+		return m_burstRead ? OMX_INVALID_PTS : m_burstPts;
+	}
+
+	// copies the next chunk of the pending burst, returns its size
+	unsigned int Read(uint8_t *dst, unsigned int size)
+	{
+		if (size > m_burstSize - m_burstRead)
+			size = m_burstSize - m_burstRead;
+
+		memcpy(dst, m_burst + m_burstRead, size);
+		m_burstRead += size;
+		return size;
+	}
+
+private:
+
+	cRpiIec61937(const cRpiIec61937&);
+	cRpiIec61937& operator= (const cRpiIec61937&);
+
+	// MPEG-2 LSF and E-AC-3 bursts are sent at a multiple of the stream's
+	// sampling rate to fit into their repetition period
+	static unsigned int RateFactor(cAudioCodec::eCodec codec,
+			unsigned int samplingRate)
+	{
+		return	codec == cAudioCodec::eEAC3 ? 4 :
+				codec == cAudioCodec::eMPG && samplingRate < 32000 ? 2 : 1;
+	}
+
+	static unsigned int FrameSamples(cAudioCodec::eCodec codec,
+			const uint8_t *p)
+	{
+		switch (codec)
+		{
+		case cAudioCodec::eMPG:
+		{
+			int layer = 4 - ((p[1] >> 1) & 0x03);
+			return layer == 1 ? 384 : layer == 2 || (p[1] & 0x08) ? 1152 : 576;
+		}
+		case cAudioCodec::eAC3:
+			return 1536;
+
+		case cAudioCodec::eEAC3:
+		{
+			static const unsigned int blocks[4] = { 1, 2, 3, 6 };
+			return 256 * ((p[4] & 0xC0) == 0xC0 ? 6 : blocks[(p[4] >> 4) & 0x03]);
+		}
+		case cAudioCodec::eDTS:
+		{
+			// only frames of 512, 1024 and 2048 samples can be packed
+			unsigned int samples = 32 * ((((p[4] & 0x01) << 6) | (p[5] >> 2)) + 1);
+			return samples == 512 || samples == 1024 || samples == 2048 ?
+					samples : 0;
+		}
+		default:
+			return 0;
+		}
+	}
+
+	// copies a frame behind the preamble, swapped to 16 bit little endian words
+	void Append(const uint8_t *p, unsigned int size)
+	{
+		uint8_t *dst = m_burst + IEC61937_PREAMBLE + m_size;
+		for (unsigned int i = 0; i + 1 < size; i += 2)
+		{
+			dst[i] = p[i + 1];
+			dst[i + 1] = p[i];
+		}
+		if (size & 1)
+		{
+			dst[size - 1] = 0;
+			dst[size] = p[size - 1];
+		}
+		m_size += (size + 1) & ~1;
+	}
+
+	void Complete(int dataType, int info, unsigned int period,
+			bool lengthInBytes)
+	{
+		unsigned int offset = IEC61937_PREAMBLE;
+		if (m_size + IEC61937_PREAMBLE > period)
+		{
+			// DTS frames filling their whole period are sent without preamble
+			if (m_size != period)
+			{
+				ELOG("IEC 61937 burst exceeds repetition period!");
+				m_size = 0;
+				m_samples = 0;
+				return;
+			}
+			memmove(m_burst, m_burst + IEC61937_PREAMBLE, m_size);
+			offset = 0;
+		}
+		else
+		{
+			unsigned int length = lengthInBytes ? m_size : m_size * 8;
+			const uint16_t preamble[4] = {
+				0xF872, 0x4E1F, (uint16_t)(dataType | info << 8), (uint16_t)length
+			};
+			for (int i = 0; i < 4; i++)
+			{
+				m_burst[2 * i] = preamble[i] & 0xFF;
+				m_burst[2 * i + 1] = preamble[i] >> 8;
+			}
+		}
+		memset(m_burst + offset + m_size, 0, period - offset - m_size);
+
+		m_burstSize = period;
+		m_burstRead = 0;
+		m_burstPts = m_pts;
+		m_size = 0;
+		m_samples = 0;
+	}
+
+	uint8_t      m_burst[IEC61937_MAX_BURST];
+	unsigned int m_size;
+	unsigned int m_samples;
+	int64_t      m_pts;
+	unsigned int m_burstSize;
+	unsigned int m_burstRead;
+	int64_t      m_burstPts;
+};
+
+#endif
@@ -20,6 +20,7 @@
 #include "omx.h"
 #include "display.h"
 #include "setup.h"
+#include "trace.h"
 
 #include <vdr/tools.h>
 #include <sys/time.h>
@@ -34,6 +35,9 @@
 #define OMX_AUDIO_BUFFERS 128
 #define OMX_AUDIO_BUFFERSIZE KILOBYTE(16);
 
+// number of audio buffers in low power mode (512k)
+#define OMX_AUDIO_BUFFERS_LOW_POWER 32
+
 #define OMX_INIT_STRUCT(a) \
 	memset(&(a), 0, sizeof(a)); \
 	(a).nSize = sizeof(a); \
@@ -202,7 +206,9 @@ void cOmx::GetBufferUsage(int &audio, int &video) const
 		audio += m_usedAudioBuffers[i].load(std::memory_order_relaxed);
 	for (unsigned i = 0; i < BUFFERSTAT_FILTER_SIZE; i++)
 		video += m_usedVideoBuffers[i].load(std::memory_order_relaxed);
-	audio /= BUFFERSTAT_FILTER_SIZE * OMX_AUDIO_BUFFERS / 100;
+	int audioBuffers = m_audioBuffers.load(std::memory_order_relaxed);
+	audio /= BUFFERSTAT_FILTER_SIZE *
+			(audioBuffers ? audioBuffers : OMX_AUDIO_BUFFERS) / 100;
 	video /= BUFFERSTAT_FILTER_SIZE * OMX_VIDEO_BUFFERS / 100;
 }
 
@@ -217,6 +223,15 @@ void cOmx::HandlePortBufferEmptied(eOmxComponent component)
 
 	case eAudioRender:
 		buf = m_usedAudioBuffers;
+		{
+			// buffers returned after a flush may arrive after the reset
+			int queued = m_queuedAudioBuffers.load(std::memory_order_relaxed);
+			while (queued > 0 && !m_queuedAudioBuffers.compare_exchange_weak(
+					queued, queued - 1, std::memory_order_relaxed))
+				;
+		}
+		if (m_onAudioBufferEmptied)
+			m_onAudioBufferEmptied(m_onAudioBufferEmptiedData);
 		break;
 
 	default:
@@ -234,12 +249,14 @@ void cOmx::HandlePortSettingsChanged(unsigned int portId)
 		goto done;
 
 	DBG("HandlePortSettingsChanged(%d)", portId);
+	cRpiTrace::Add(cRpiTrace::ePortSettingsChanged, portId);
 
 	switch (portId)
 	{
 	case 191:
 		if (ilclient_setup_tunnel(&m_tun[eVideoFxToVideoScheduler], 0, 0) != 0)
 			ELOG("failed to setup up tunnel from video fx to scheduler!");
+		cRpiTrace::Add(cRpiTrace::eTunnelSetup, eVideoFxToVideoScheduler);
 		if (ilclient_change_component_state(m_comp[eVideoScheduler], OMX_StateExecuting) != 0)
 			ELOG("failed to enable video scheduler!");
 		break;
@@ -340,6 +357,7 @@ void cOmx::HandlePortSettingsChanged(unsigned int portId)
 
 		if (ilclient_setup_tunnel(&m_tun[eVideoDecoderToVideoFx], 0, 0) != 0)
 			ELOG("failed to setup up tunnel from video decoder to fx!");
+		cRpiTrace::Add(cRpiTrace::eTunnelSetup, eVideoDecoderToVideoFx);
 		if (ilclient_change_component_state(m_comp[eVideoFx], OMX_StateExecuting) != 0)
 			ELOG("failed to enable video fx!");
 
@@ -348,8 +366,13 @@ void cOmx::HandlePortSettingsChanged(unsigned int portId)
 	case 11:
 		if (ilclient_setup_tunnel(&m_tun[eVideoSchedulerToVideoRender], 0, 0) != 0)
 			ELOG("failed to setup up tunnel from scheduler to render!");
+		cRpiTrace::Add(cRpiTrace::eTunnelSetup, eVideoSchedulerToVideoRender);
 		if (ilclient_change_component_state(m_comp[eVideoRender], OMX_StateExecuting) != 0)
 			ELOG("failed to enable video render!");
+
+		// the scheduler only reports its output settings once the first
+		// frame is ready, so the render starts displaying from now on
+		cRpiTrace::Add(cRpiTrace::eVideoRenderStart);
 		break;
 	}
 
@@ -527,6 +550,13 @@ void cOmx::SetStreamStartCallback(void (*onStreamStart)(void*), void* data)
 	m_onStreamStartData = data;
 }
 
+void cOmx::SetAudioBufferEmptiedCallback(void (*onAudioBufferEmptied)(void*),
+		void* data)
+{
+	m_onAudioBufferEmptied = onAudioBufferEmptied;
+	m_onAudioBufferEmptiedData = data;
+}
+
 OMX_TICKS cOmx::ToOmxTicks(int64_t val)
 {
 	OMX_TICKS ticks;
@@ -594,6 +624,8 @@ void cOmx::StartClock(bool waitForVideo, bool waitForAudio, int preRollMs)
 	DBG("StartClock(%svideo, %saudio)",
 			waitForVideo ? "" : "no ",
 			waitForAudio ? "" : "no ");
+	cRpiTrace::Add(cRpiTrace::eStartClock,
+			(waitForVideo ? 1 : 0) | (waitForAudio ? 2 : 0));
 
 	OMX_TIME_CONFIG_CLOCKSTATETYPE cstate;
 	OMX_INIT_STRUCT(cstate);
@@ -805,6 +837,30 @@ bool cOmx::IsBufferStall(void)
 	return stallConf.bStalled == OMX_TRUE;
 }
 
+void cOmx::GetVideoFrameCount(unsigned int &decoded, unsigned int &dropped)
+{
+	decoded = 0;
+	dropped = 0;
+
+	OMX_CONFIG_BRCMPORTSTATSTYPE stats;
+	OMX_INIT_STRUCT(stats);
+	stats.nPortIndex = 131;
+	if (OMX_GetConfig(ILC_GET_HANDLE(m_comp[eVideoDecoder]),
+			OMX_IndexConfigBrcmPortStats, &stats) != OMX_ErrorNone)
+		ELOG("failed to get video decoder port stats!");
+	else
+		decoded = stats.nFrameCount;
+
+	// frames dropped by the scheduler due to late arrival
+	OMX_INIT_STRUCT(stats);
+	stats.nPortIndex = 10;
+	if (OMX_GetConfig(ILC_GET_HANDLE(m_comp[eVideoScheduler]),
+			OMX_IndexConfigBrcmPortStats, &stats) != OMX_ErrorNone)
+		ELOG("failed to get video scheduler port stats!");
+	else
+		dropped = stats.nFrameSkips + stats.nDiscards;
+}
+
 void cOmx::SetVolume(int vol)
 {
 	OMX_AUDIO_CONFIG_VOLUMETYPE volume;
@@ -830,6 +886,13 @@ void cOmx::SetMute(bool mute)
 		ELOG("failed to set mute state!");
 }
 
+void cOmx::SetLowPower(bool lowPower)
+{
+	Lock();
+	m_lowPower = lowPower;
+	Unlock();
+}
+
 void cOmx::StopVideo(void)
 {
 	Lock();
@@ -881,6 +944,7 @@ void cOmx::StopAudio(void)
 			m_spareAudioBuffers, NULL, NULL);
 
 	m_spareAudioBuffers = 0;
+	m_queuedAudioBuffers.store(0, std::memory_order_relaxed);
 	Unlock();
 }
 
@@ -1124,7 +1188,9 @@ int cOmx::SetupAudioRender(cAudioCodec::eCodec outputFormat, int channels,
 		ELOG("failed to get audio render port parameters!");
 
 	param.nBufferSize = OMX_AUDIO_BUFFERSIZE;
-	param.nBufferCountActual = OMX_AUDIO_BUFFERS;
+	param.nBufferCountActual = m_lowPower ?
+			OMX_AUDIO_BUFFERS_LOW_POWER : OMX_AUDIO_BUFFERS;
+	m_audioBuffers.store(param.nBufferCountActual, std::memory_order_relaxed);
 	memset((void*) m_usedAudioBuffers, 0, sizeof m_usedAudioBuffers);
 
 	if (OMX_SetParameter(ILC_GET_HANDLE(m_comp[eAudioRender]),
@@ -1325,7 +1391,9 @@ bool cOmx::EmptyAudioBuffer(OMX_BUFFERHEADERTYPE *buf)
 	Lock();
 	OMX_ERRORTYPE o = OMX_EmptyThisBuffer(ILC_GET_HANDLE(m_comp[eAudioRender]), buf);
 
-	if (o != OMX_ErrorNone)
+	if (o == OMX_ErrorNone)
+		m_queuedAudioBuffers.fetch_add(1, std::memory_order_relaxed);
+	else
 	{
 		ELOG("failed to empty OMX audio buffer");
 
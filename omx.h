@@ -30,8 +30,6 @@ extern "C"
 #include "ilclient.h"
 }
 
-#define OMX_INVALID_PTS -1
-
 class cOmxEvents;
 
 class cOmx : public cThread
@@ -45,6 +43,8 @@ public:
 	void SetBufferStallCallback(void (*onBufferStall)(void*), void* data);
 	void SetEndOfStreamCallback(void (*onEndOfStream)(void*), void* data);
 	void SetStreamStartCallback(void (*onStreamStart)(void*), void* data);
+	void SetAudioBufferEmptiedCallback(void (*onAudioBufferEmptied)(void*),
+			void* data);
 
 	static OMX_TICKS ToOmxTicks(int64_t val);
 	static int64_t FromOmxTicks(OMX_TICKS &ticks);
@@ -84,6 +84,9 @@ public:
 	void StopVideo(void);
 	void StopAudio(void);
 
+	// use less audio buffers, applied with the next audio render setup
+	void SetLowPower(bool lowPower);
+
 	void SetVideoErrorConcealment(bool startWithValidFrame);
 	void SetVideoDecoderExtraBuffers(int extraBuffers);
 
@@ -113,9 +116,12 @@ public:
 	bool PollVideo(void) const;
 
 	bool EmptyAudioBuffer(OMX_BUFFERHEADERTYPE *buf);
+	int GetQueuedAudioBuffers(void) const
+	{ return m_queuedAudioBuffers.load(std::memory_order_relaxed); }
 	bool EmptyVideoBuffer(OMX_BUFFERHEADERTYPE *buf);
 
 	void GetBufferUsage(int &audio, int &video) const;
+	void GetVideoFrameCount(unsigned int &decoded, unsigned int &dropped);
 
 private:
 	struct Event
@@ -180,6 +186,13 @@ private:
 	std::atomic<int16_t> m_usedAudioBuffers[BUFFERSTAT_FILTER_SIZE] = {};
 	std::atomic<int16_t> m_usedVideoBuffers[BUFFERSTAT_FILTER_SIZE] = {};
 
+	/** number of audio buffers passed to the render and not yet emptied */
+	std::atomic<int> m_queuedAudioBuffers{0};
+
+	/** number of audio buffers allocated for the render */
+	std::atomic<int> m_audioBuffers{0};
+	bool m_lowPower = false;
+
 	OMX_BUFFERHEADERTYPE* m_spareAudioBuffers = nullptr;
 	OMX_BUFFERHEADERTYPE* m_spareVideoBuffers = nullptr;
 	eClockReference	m_clockReference = eClockRefNone;
@@ -203,6 +216,11 @@ private:
 	void (*m_onStreamStart)(void*) = nullptr;
 	void *m_onStreamStartData = nullptr;
 
+	/** pointer to cRpiAudioDecoder::OnAudioBufferEmptied(); set while the
+	audio decoder is initialized */
+	void (*m_onAudioBufferEmptied)(void*) = nullptr;
+	void *m_onAudioBufferEmptiedData = nullptr;
+
 	unsigned GetCurrentStat(void) const
 	{ return m_bufferStat.load(std::memory_order_relaxed) % BUFFERSTAT_FILTER_SIZE; }
 
@@ -23,6 +23,8 @@
 #include "display.h"
 #include "setup.h"
 #include "tools.h"
+#include "trace.h"
+#include "ovgosd.h"
 
 #include <vdr/thread.h>
 #include <vdr/remux.h>
@@ -37,6 +39,9 @@
 #define PRE_ROLL_LIVE 250
 #define PRE_ROLL_PLAYBACK 0
 
+// time of audio-only playback until video is parked, in ms
+#define LOW_POWER_DELAY 5000
+
 // trick speeds as defined in vdr/dvbplayer.c
 const int cOmxDevice::s_playbackSpeeds[eNumDirections][eNumPlaybackSpeeds] = {
 	{ S(0.0f), S( 0.125f), S( 0.25f), S( 0.5f), S( 1.0f), S( 2.0f), S( 4.0f), S( 12.0f) },
@@ -71,11 +76,17 @@ cOmxDevice::cOmxDevice(void (*onPrimaryDevice)(void), int display, int layer) :
 	m_hasVideo(false),
 	m_hasAudio(false),
 	m_skipAudio(false),
+	m_lowPower(false),
 	m_playDirection(0),
 	m_trickRequest(0),
 	m_audioPts(0),
 	m_videoPts(0),
 	m_lastStc(0),
+	m_audioTrack(ttNone),
+	m_prevAudioTrack(ttNone),
+	m_altAudioTrack(ttNone),
+	m_altAudioPid(0),
+	m_altAudioTsToPes(),
 	m_display(display),
 	m_layer(layer)
 {
@@ -103,6 +114,7 @@ int cOmxDevice::Init(void)
 		return -1;
 	}
 	cRpiSetup::SetVideoSetupChangedCallback(&OnVideoSetupChanged, this);
+	cRpiOsdProvider::SetStatsCallback(&OnGetStats, this);
 
 	return 0;
 }
@@ -111,6 +123,7 @@ void cOmxDevice::DeInit(void)
 {
 	SetPlayMode(pmNone);
 	cRpiSetup::SetVideoSetupChangedCallback(0);
+	cRpiOsdProvider::SetStatsCallback(0);
 }
 
 bool cOmxDevice::Start(void)
@@ -154,6 +167,8 @@ bool cOmxDevice::SetPlayMode(ePlayMode PlayMode)
 		PlayMode == pmVideoOnly		 ? "Video only" 	   : 
 									   "unsupported");
 
+	cRpiTrace::Add(cRpiTrace::eSetPlayMode, PlayMode);
+
 	// Stop audio / video if play mode is set to pmNone. Start
 	// is triggered once a packet is going to be played, since
 	// we don't know what kind of stream we'll get (audio-only,
@@ -169,6 +184,8 @@ bool cOmxDevice::SetPlayMode(ePlayMode PlayMode)
 		m_hasAudio = false;
 		m_hasVideo = false;
 		m_videoCodec = cVideoCodec::eInvalid;
+		if (m_lowPower)
+			SetLowPower(false);
 		m_audio.DeInit();
 		m_omx.DeInit();
 		m_playMode = pmNone;
@@ -261,6 +278,123 @@ void cOmxDevice::StillPicture(const uchar *Data, int Length)
 	}
 }
 
+// the A/V delay is applied as PTS offset to either audio or video
+static int64_t AudioDelay(void)
+{
+	int delay = cRpiSetup::GetAudioDelay();
+	return delay > 0 ? delay * 90 : 0;
+}
+
+static int64_t VideoDelay(void)
+{
+	int delay = cRpiSetup::GetAudioDelay();
+	return delay < 0 ? -delay * 90 : 0;
+}
+
+int cOmxDevice::PlayTs(const uchar *Data, int Length, bool VideoOnly)
+{
+	if (!Data)
+	{
+		m_mutex.Lock();
+		m_altAudioTsToPes.Reset();
+		m_mutex.Unlock();
+		return cDevice::PlayTs(Data, Length, VideoOnly);
+	}
+
+	// switch tracks before the first packet of the new one is played
+	UpdateAudioTracks();
+
+	int ret = cDevice::PlayTs(Data, Length, VideoOnly);
+
+	// feed the alternate audio track with the packets which have been played
+	if (ret > 0 && !VideoOnly && m_altAudioPid)
+		for (int i = 0; i + TS_SIZE <= ret; i += TS_SIZE)
+			if (TsPid(Data + i) == m_altAudioPid)
+				PlayAlternateAudio(Data + i);
+
+	return ret;
+}
+
+void cOmxDevice::UpdateAudioTracks(void)
+{
+	m_mutex.Lock();
+
+	eTrackType track = GetCurrentAudioTrack();
+	if (track != m_audioTrack)
+	{
+		// the decoder keeps the previous track as alternate
+		if (m_hasAudio && track == m_altAudioTrack && m_audio.SwitchTrack())
+		{
+			const tTrackId *prev = GetTrack(m_audioTrack);
+			m_altAudioTrack = m_audioTrack;
+			m_altAudioPid = prev ? prev->id : 0;
+		}
+		else if (m_hasAudio)
+			DLOG("no alternate data for audio track %d, draining", track);
+
+		m_altAudioTsToPes.Reset();
+		m_prevAudioTrack = m_audioTrack;
+		m_audioTrack = track;
+	}
+
+	eTrackType altTrack = AlternateAudioTrack();
+	int altPid = altTrack != ttNone ? GetTrack(altTrack)->id : 0;
+	if (altTrack != m_altAudioTrack || altPid != m_altAudioPid)
+	{
+		m_audio.ResetAlternate();
+		m_altAudioTsToPes.Reset();
+		m_altAudioTrack = altTrack;
+		m_altAudioPid = altPid;
+	}
+
+	m_mutex.Unlock();
+}
+
+eTrackType cOmxDevice::AlternateAudioTrack(void)
+{
+	// most likely, the user switches back to the previous track...
+	const tTrackId *track = GetTrack(m_prevAudioTrack);
+	if (m_prevAudioTrack != m_audioTrack && track && track->id)
+		return m_prevAudioTrack;
+
+	// ... or from stereo to surround and vice versa
+	bool dolby = IS_DOLBY_TRACK(m_audioTrack);
+	for (int i = dolby ? ttAudioFirst : ttDolbyFirst;
+			i <= (dolby ? ttAudioLast : ttDolbyLast); i++)
+	{
+		track = GetTrack((eTrackType)i);
+		if (track && track->id)
+			return (eTrackType)i;
+	}
+	return ttNone;
+}
+
+void cOmxDevice::PlayAlternateAudio(const uchar *Data)
+{
+	m_mutex.Lock();
+
+	// collect PES packets just as cDevice::PlayTsAudio()
+	if (TsPayloadStart(Data))
+	{
+		int length;
+		while (const uchar *pes = m_altAudioTsToPes.GetPes(length))
+		{
+			int payload = length - PesPayloadOffset(pes);
+
+			// the alternate track is only needed in normal playback
+			if (m_hasAudio && m_playbackSpeed == eNormal && payload > 0)
+				m_audio.WriteAlternateData(pes + PesPayloadOffset(pes), payload,
+						PesHasPts(pes) ? m_audioPts + PtsDiff(
+						m_audioPts & MAX33BIT, PesGetPts(pes)) + AudioDelay() :
+						OMX_INVALID_PTS);
+		}
+		m_altAudioTsToPes.Reset();
+	}
+	m_altAudioTsToPes.PutTs(Data, TS_SIZE);
+
+	m_mutex.Unlock();
+}
+
 int cOmxDevice::PlayAudio(const uchar *Data, int Length, uchar Id)
 {
 	// ignore audio packets during fast trick speeds for non-radio recordings
@@ -278,6 +412,7 @@ int cOmxDevice::PlayAudio(const uchar *Data, int Length, uchar Id)
 	{
 		if (!m_hasAudio)
 		{
+			cRpiTrace::Add(cRpiTrace::eFirstAudioPes, m_hasVideo);
 			m_hasAudio = true;
 			m_omx.SetClockReference(cOmx::eClockRefAudio);
 
@@ -290,6 +425,7 @@ int cOmxDevice::PlayAudio(const uchar *Data, int Length, uchar Id)
 						Transferring() ? PRE_ROLL_LIVE : PRE_ROLL_PLAYBACK);
 				m_audioPts = PTS_START_OFFSET + pts;
 				m_playMode = pmAudioOnly;
+				m_audioOnlyTimer.Set(LOW_POWER_DELAY);
 			}
 			else
 			{
@@ -308,6 +444,11 @@ int cOmxDevice::PlayAudio(const uchar *Data, int Length, uchar Id)
 		// keep track of direction in case of trick speed
 		if (m_trickRequest && ptsDiff)
 			PtsTracker(ptsDiff);
+
+		// audio-only for a while, most probably radio
+		if (!m_lowPower && !m_hasVideo && m_playMode == pmAudioOnly &&
+				m_audioOnlyTimer.TimedOut())
+			SetLowPower(true);
 	}
 
 	int length = Length - PesPayloadOffset(Data);
@@ -325,8 +466,8 @@ int cOmxDevice::PlayAudio(const uchar *Data, int Length, uchar Id)
 			data += 4;
 			length -= 4;
 		}
-		if (!m_audio.WriteData(data, length,
-				pts != OMX_INVALID_PTS ? m_audioPts : OMX_INVALID_PTS))
+		if (!m_audio.WriteData(data, length, pts != OMX_INVALID_PTS ?
+				m_audioPts + AudioDelay() : OMX_INVALID_PTS))
 			ret = 0;
 	}
 
@@ -360,9 +501,13 @@ int cOmxDevice::PlayVideo(const uchar *Data, int Length, bool EndOfFrame)
 	{
 		if (codec != cVideoCodec::eInvalid)
 		{
+			if (m_lowPower)
+				SetLowPower(false);
+
 			m_videoCodec = codec;
 			if (cRpiSetup::IsVideoCodecSupported(m_videoCodec))
 			{
+				cRpiTrace::Add(cRpiTrace::eSetVideoCodec, m_videoCodec);
 				m_omx.SetVideoCodec(m_videoCodec);
 				DLOG("set video codec to %s", cVideoCodec::Str(m_videoCodec));
 			}
@@ -374,6 +519,7 @@ int cOmxDevice::PlayVideo(const uchar *Data, int Length, bool EndOfFrame)
 	if (!m_hasVideo && pts != OMX_INVALID_PTS &&
 			cRpiSetup::IsVideoCodecSupported(m_videoCodec))
 	{
+		cRpiTrace::Add(cRpiTrace::eFirstVideoPes, m_hasAudio);
 		m_hasVideo = true;
 		if (!m_hasAudio)
 		{
@@ -410,8 +556,8 @@ int cOmxDevice::PlayVideo(const uchar *Data, int Length, bool EndOfFrame)
 
 		while (Length > 0)
 		{
-			if (OMX_BUFFERHEADERTYPE *buf =	m_omx.GetVideoBuffer(
-					pts != OMX_INVALID_PTS ? m_videoPts : OMX_INVALID_PTS))
+			if (OMX_BUFFERHEADERTYPE *buf =	m_omx.GetVideoBuffer(pts !=
+					OMX_INVALID_PTS ? m_videoPts + VideoDelay() : OMX_INVALID_PTS))
 			{
 				buf->nFilledLen = buf->nAllocLen < (unsigned)Length ?
 						buf->nAllocLen : Length;
@@ -526,9 +672,16 @@ void cOmxDevice::Clear(void)
 	m_mutex.Lock();
 
 	FlushStreams();
+	m_altAudioTsToPes.Reset();
 	m_hasAudio = false;
 	m_hasVideo = false;
 
+	// the number of audio render buffers only follows the mode when the
+	// render is set up again, so start over with the full pool in case the
+	// audio of a TV channel arrives before its video
+	if (m_lowPower)
+		SetLowPower(false);
+
 	m_mutex.Unlock();
 	cDevice::Clear();
 }
@@ -638,6 +791,12 @@ void cOmxDevice::AdjustLiveSpeed(void)
 		m_omx.GetBufferUsage(usedAudioBuffers, usedVideoBuffers);
 		usedBuffers = m_hasAudio ? usedAudioBuffers : usedVideoBuffers;
 
+		// decoded audio is staged beyond half the latency target only if
+		// the render has run out of buffers
+		if (m_hasAudio && m_audio.GetStagedTime() >
+				cRpiSetup::GetAudioLatencyTarget() / 2)
+			usedBuffers = 100;
+
 		if (usedBuffers < 5)
 			m_liveSpeed = eNegCorrection;
 
@@ -662,6 +821,49 @@ void cOmxDevice::AdjustLiveSpeed(void)
 	}
 }
 
+void cOmxDevice::GetStats(tPipelineStats &stats)
+{
+	m_mutex.Lock();
+
+	stats.hasAudio = m_hasAudio;
+	stats.hasVideo = m_hasVideo;
+	m_omx.GetBufferUsage(stats.audioBuffer, stats.videoBuffer);
+
+	int64_t stc = m_omx.IsClockRunning() ? m_omx.GetSTC() : OMX_INVALID_PTS;
+	stats.audioBufferedMs = m_hasAudio && stc != OMX_INVALID_PTS ?
+			(m_audioPts - stc) / 90 : 0;
+	stats.audioStagedMs = m_hasAudio ? m_audio.GetStagedTime() : 0;
+	stats.audioLatencyTargetMs = cRpiSetup::GetAudioLatencyTarget();
+	stats.videoBufferedMs = m_hasVideo && stc != OMX_INVALID_PTS ?
+			(m_videoPts - stc) / 90 : 0;
+	stats.avOffsetMs = m_hasAudio && m_hasVideo ?
+			(m_videoPts - m_audioPts) / 90 : 0;
+	stats.liveSpeed = Transferring() ? m_liveSpeed - eNoCorrection : 0;
+
+	// the video decoder is stopped without video, don't query its ports
+	if (m_hasVideo)
+		m_omx.GetVideoFrameCount(stats.decodedFrames, stats.droppedFrames);
+	stats.audioCpuTimeUs = m_audio.GetCpuTime();
+
+	m_mutex.Unlock();
+}
+
+void cOmxDevice::SetLowPower(bool lowPower)
+{
+	DLOG("%s low power mode", lowPower ? "entering" : "leaving");
+
+	// release video decoder buffers, they're set up again with the first
+	// video PES, just as after a channel switch
+	if (lowPower && m_videoCodec != cVideoCodec::eInvalid)
+	{
+		m_omx.StopVideo();
+		m_videoCodec = cVideoCodec::eInvalid;
+	}
+	m_omx.SetLowPower(lowPower);
+	m_audio.SetLowPower(lowPower);
+	m_lowPower = lowPower;
+}
+
 void cOmxDevice::HandleBufferStall()
 {
 	ELOG("buffer stall!");
@@ -694,6 +896,7 @@ void cOmxDevice::HandleEndOfStream()
 void cOmxDevice::HandleStreamStart()
 {
 	DBG("HandleStreamStart()");
+	cRpiTrace::Add(cRpiTrace::eStreamStart);
 
 	const cVideoFrameFormat *format = m_omx.GetVideoFrameFormat();
 	DLOG("video stream started %dx%d@%d%s, PAR=%d/%d",
@@ -746,6 +949,7 @@ void cOmxDevice::HandleVideoSetupChanged()
 void cOmxDevice::FlushStreams(bool flushVideoRender)
 {
 	DBG("FlushStreams(%s)", flushVideoRender ? "flushVideoRender" : "");
+	cRpiTrace::Add(cRpiTrace::eFlushStreams, flushVideoRender);
 	m_omx.StopClock();
 
 	if (m_hasVideo)
@@ -21,6 +21,7 @@
 #define OMX_DEVICE_H
 
 #include <vdr/device.h>
+#include <vdr/remux.h>
 #include "audio.h"
 
 class cOmxDevice : cDevice
@@ -53,6 +54,7 @@ public:
 
 	virtual void StillPicture(const uchar *Data, int Length);
 
+	virtual int PlayTs(const uchar *Data, int Length, bool VideoOnly = false);
 	virtual int PlayAudio(const uchar *Data, int Length, uchar Id);
 	virtual int PlayVideo(const uchar *Data, int Length)
 		{ return PlayVideo(Data, Length, false); }
@@ -78,6 +80,9 @@ public:
 
 	virtual bool Poll(cPoller &Poller, int TimeoutMs = 0);
 
+	cString GetAudioStats(void) { return m_audio.GetStats(); }
+	void ResetAudioStats(void) { m_audio.ResetStats(); }
+
 protected:
 
 	virtual void MakePrimaryDevice(bool On);
@@ -145,6 +150,9 @@ private:
 	void (*m_onPrimaryDevice)(void);
 	virtual cVideoCodec::eCodec ParseVideoCodec(const uchar *data, int length);
 
+	static void OnGetStats(void *data, tPipelineStats &stats)
+		{ (static_cast <cOmxDevice*> (data))->GetStats(stats); }
+
 	static void OnBufferStall(void *data)
 		{ (static_cast <cOmxDevice*> (data))->HandleBufferStall(); }
 
@@ -161,6 +169,7 @@ private:
 	void HandleEndOfStream();
 	void HandleStreamStart();
 	void HandleVideoSetupChanged();
+	void GetStats(tPipelineStats &stats);
 
 	void FlushStreams(bool flushVideoRender = false);
 	bool SubmitEOS(void);
@@ -169,11 +178,17 @@ private:
 	void PtsTracker(int64_t ptsDiff);
 
 	void AdjustLiveSpeed(void);
+	void SetLowPower(bool lowPower);
+
+	void UpdateAudioTracks(void);
+	eTrackType AlternateAudioTrack(void);
+	void PlayAlternateAudio(const uchar *Data);
 
 	cOmx			 m_omx;
 	cRpiAudioDecoder m_audio;
 	cMutex			 m_mutex;
 	cTimeMs 		 m_timer;
+	cTimeMs 		 m_audioOnlyTimer;
 
 	cVideoCodec::eCodec	m_videoCodec;
 
@@ -186,6 +201,7 @@ private:
 	bool	m_hasAudio;
 
 	bool	m_skipAudio;
+	bool	m_lowPower;
 	int		m_playDirection;
 	int		m_trickRequest;
 
@@ -194,6 +210,12 @@ private:
 
 	int64_t	m_lastStc;
 
+	eTrackType	m_audioTrack;
+	eTrackType	m_prevAudioTrack;
+	eTrackType	m_altAudioTrack;
+	int			m_altAudioPid;
+	cTsToPes	m_altAudioTsToPes;
+
 	int m_display;
 	int m_layer;
 };
@@ -19,6 +19,10 @@
 
 #include <vector>
 #include <queue>
+#include <atomic>
+#include <string>
+#include <list>
+#include <map>
 #include <algorithm>
 
 #include <ft2build.h>
@@ -746,22 +750,370 @@ private:
 
 /* ------------------------------------------------------------------------- */
 
+// window surface of the performance overlay, which lives in its own dispmanx
+// element on top of the OSD, so it never interferes with the OSD content
+
+class cOvgOverlay : public cOvgRenderTarget
+{
+public:
+
+	cOvgOverlay(int layer) : cOvgRenderTarget(), m_layer(layer), m_display(0)
+	{
+		memset(&m_window, 0, sizeof(m_window));
+	}
+
+	bool Open(cEgl *egl, int w, int h)
+	{
+		if (surface != EGL_NO_SURFACE)
+		{
+			if (w == width && h == height)
+				return true;
+			Close(egl);
+		}
+
+		int displayWidth, displayHeight;
+		cRpiDisplay::GetSize(displayWidth, displayHeight);
+		w = std::min(w, displayWidth);
+		h = std::min(h, displayHeight);
+
+		m_display = vc_dispmanx_display_open(cRpiDisplay::GetId());
+		DISPMANX_UPDATE_HANDLE_T update = vc_dispmanx_update_start(0);
+
+		VC_RECT_T srcRect = { 0, 0, w << 16, h << 16 };
+		VC_RECT_T dstRect = { displayWidth / 32, displayHeight / 32, w, h };
+
+		m_window.element = vc_dispmanx_element_add(
+				update, m_display, m_layer, &dstRect, 0, &srcRect,
+				DISPMANX_PROTECTION_NONE, 0, 0, (DISPMANX_TRANSFORM_T)0);
+		m_window.width = w;
+		m_window.height = h;
+
+		vc_dispmanx_update_submit_sync(update);
+
+		surface = eglCreateWindowSurface(egl->display, egl->config,
+				&m_window, NULL);
+		if (surface == EGL_NO_SURFACE)
+		{
+			ELOG("[EGL] failed to create overlay surface: %s!",
+					cEgl::errStr(eglGetError()));
+			Close(egl);
+			return false;
+		}
+		width = w;
+		height = h;
+		return true;
+	}
+
+	void Close(cEgl *egl)
+	{
+		if (surface != EGL_NO_SURFACE)
+		{
+			if (egl->currentSurface == surface)
+				MakeDefault(egl);
+
+			if (eglDestroySurface(egl->display, surface) == EGL_FALSE)
+				ELOG("[EGL] failed to destroy overlay surface: %s!",
+						cEgl::errStr(eglGetError()));
+			surface = EGL_NO_SURFACE;
+		}
+		if (m_display)
+		{
+			DISPMANX_UPDATE_HANDLE_T update = vc_dispmanx_update_start(0);
+			vc_dispmanx_element_remove(update, m_window.element);
+			vc_dispmanx_update_submit_sync(update);
+			vc_dispmanx_display_close(m_display);
+			m_display = 0;
+		}
+	}
+
+	virtual bool MakeCurrent(cEgl *egl)
+	{
+		if (egl->currentSurface == surface)
+			return true;
+
+		if (eglMakeCurrent(egl->display, surface, surface, egl->context) ==
+				EGL_FALSE)
+		{
+			ELOG("[EGL] failed to connect context to surface: %s!",
+					cEgl::errStr(eglGetError()));
+			return false;
+		}
+		egl->currentSurface = surface;
+		return true;
+	}
+
+private:
+
+	int m_layer;
+	DISPMANX_DISPLAY_HANDLE_T m_display;
+	EGL_DISPMANX_WINDOW_T m_window;
+};
+
+/* ------------------------------------------------------------------------- */
+
+// execution times per command type in log2 histograms of microseconds,
+// bucket n counts all samples below 2^n us
+
+#define OVG_PROFILE_TYPES   48
+#define OVG_PROFILE_BUCKETS 24
+
+class cOvgProfiler
+{
+public:
+
+	static void Add(const char *type, int64_t us)
+	{
+		s_mutex.Lock();
+		tEntry *entry = Get(type);
+		if (entry)
+		{
+			int bucket = 0;
+			for (int64_t v = us; v > 0 && bucket < OVG_PROFILE_BUCKETS - 1;
+					v >>= 1)
+				bucket++;
+
+			entry->buckets[bucket]++;
+			entry->count++;
+			entry->total += us;
+			if (us > entry->max)
+				entry->max = us;
+		}
+		s_mutex.Unlock();
+	}
+
+	static void Clear(void)
+	{
+		s_mutex.Lock();
+		s_numEntries = 0;
+		s_mutex.Unlock();
+	}
+
+	static cString Dump(bool histogram)
+	{
+		std::string ret;
+		char line[256];
+
+		s_mutex.Lock();
+		if (histogram)
+			snprintf(line, sizeof(line), "%-16s count of samples < 2^n us\n",
+					"type");
+		else
+			snprintf(line, sizeof(line), "%-16s %8s %8s %8s %8s %8s %8s %10s\n",
+					"type", "count", "avg/us", "p50/us", "p90/us", "p99/us",
+					"max/us", "total/ms");
+		ret += line;
+
+		for (int i = 0; i < s_numEntries; i++)
+		{
+			tEntry &e = s_entries[i];
+			if (histogram)
+			{
+				int n = OVG_PROFILE_BUCKETS;
+				while (n > 1 && !e.buckets[n - 1])
+					n--;
+
+				snprintf(line, sizeof(line), "%-16s", e.type);
+				ret += line;
+				for (int j = 0; j < n; j++)
+				{
+					snprintf(line, sizeof(line), " %u", e.buckets[j]);
+					ret += line;
+				}
+				ret += "\n";
+			}
+			else
+			{
+				snprintf(line, sizeof(line),
+						"%-16s %8u %8lld %8lld %8lld %8lld %8lld %10.1f\n",
+						e.type, e.count, (long long)(e.total / e.count),
+						(long long)Percentile(e, 50),
+						(long long)Percentile(e, 90),
+						(long long)Percentile(e, 99),
+						(long long)e.max, e.total / 1000.0);
+				ret += line;
+			}
+		}
+		s_mutex.Unlock();
+
+		// SVDRP replies must not end with a line break
+		ret.resize(ret.size() - 1);
+		return cString(ret.c_str());
+	}
+
+private:
+
+	struct tEntry
+	{
+		const char   *type;
+		unsigned int  count;
+		int64_t       total;
+		int64_t       max;
+		unsigned int  buckets[OVG_PROFILE_BUCKETS];
+	};
+
+	static tEntry *Get(const char *type)
+	{
+		// types are identified by their description literal
+		for (int i = 0; i < s_numEntries; i++)
+			if (s_entries[i].type == type || !strcmp(s_entries[i].type, type))
+				return &s_entries[i];
+
+		if (s_numEntries == OVG_PROFILE_TYPES)
+			return 0;
+
+		tEntry *entry = &s_entries[s_numEntries++];
+		memset(entry, 0, sizeof(tEntry));
+		entry->type = type;
+		return entry;
+	}
+
+	// upper bound of the bucket containing the given percentile
+	static int64_t Percentile(const tEntry &e, int percent)
+	{
+		unsigned int n = 0;
+		for (int i = 0; i < OVG_PROFILE_BUCKETS; i++)
+		{
+			n += e.buckets[i];
+			if (n * 100ULL >= (unsigned long long)e.count * percent)
+				return std::min((int64_t)1 << i, e.max);
+		}
+		return e.max;
+	}
+
+	static tEntry s_entries[OVG_PROFILE_TYPES];
+	static int s_numEntries;
+	static cMutex s_mutex;
+};
+
+cOvgProfiler::tEntry cOvgProfiler::s_entries[OVG_PROFILE_TYPES];
+int cOvgProfiler::s_numEntries = 0;
+cMutex cOvgProfiler::s_mutex;
+
+/* ------------------------------------------------------------------------- */
+
+// binary representation of OSD commands used for recording and replaying,
+// objects like render targets or images are identified by their address
+
+class cOvgStream
+{
+public:
+
+	enum eCmdType {
+		eFlush = 1,
+		eReset,
+		eCreatePixelBuffer,
+		eDestroySurface,
+		eClear,
+		eSaveRegion,
+		eRestoreRegion,
+		eDropRegion,
+		eDrawPixel,
+		eDrawRectangle,
+		eDrawEllipse,
+		eDrawSlope,
+		eDrawText,
+		eRenderPixels,
+		eRenderPattern,
+		eCopyPixels,
+		eMovePixels,
+		eStoreImage,
+		eDropImage,
+		eDrawImage,
+		eDrawBitmap
+	};
+
+	cOvgStream() : m_in(0), m_size(0), m_pos(0), m_error(false) { }
+
+	cOvgStream(const char *data, size_t size) :
+		m_in(data), m_size(size), m_pos(0), m_error(false) { }
+
+	template<class T> void Put(T val)
+	{
+		m_out.append((const char *)&val, sizeof(T));
+	}
+
+	void PutId(const void *ptr)
+	{
+		Put<uint64_t>((uintptr_t)ptr);
+	}
+
+	void PutData(const void *data, uint32_t size)
+	{
+		Put(size);
+		m_out.append((const char *)data, size);
+	}
+
+	template<class T> T Get(void)
+	{
+		T val = T();
+		if (m_pos + sizeof(T) > m_size)
+			m_error = true;
+		else
+		{
+			memcpy(&val, m_in + m_pos, sizeof(T));
+			m_pos += sizeof(T);
+		}
+		return val;
+	}
+
+	uint64_t GetId(void)
+	{
+		return Get<uint64_t>();
+	}
+
+	// returns a malloc'ed copy of the data with a terminating zero word
+	void *GetData(uint32_t &size)
+	{
+		size = Get<uint32_t>();
+		if (m_error || m_pos + size > m_size)
+		{
+			m_error = true;
+			return 0;
+		}
+		char *data = MALLOC(char, size + sizeof(uint32_t));
+		if (data)
+		{
+			memcpy(data, m_in + m_pos, size);
+			memset(data + size, 0, sizeof(uint32_t));
+		}
+		m_pos += size;
+		return data;
+	}
+
+	const std::string &Data(void) const { return m_out; }
+	bool Error(void) const { return m_error; }
+
+private:
+
+	std::string m_out;
+	const char *m_in;
+	size_t      m_size;
+	size_t      m_pos;
+	bool        m_error;
+};
+
+/* ------------------------------------------------------------------------- */
+
 class cOvgCmd
 {
 public:
 
-	cOvgCmd(cOvgRenderTarget *target) : m_target(target) { }
+	cOvgCmd(cOvgRenderTarget *target) : m_target(target), m_queueTime(0) { }
 	virtual ~cOvgCmd() { }
 
 	virtual bool Execute(cEgl *egl) = 0;
 	virtual const char* Description(void) = 0;
-#ifdef DEBUG_OVGSTAT
-	virtual bool IsFlush(void) { return false; };
-#endif
+
+	// commands not needed to reproduce the OSD aren't recorded
+	virtual bool Serialize(cOvgStream &s) { return false; }
+
+	void SetQueueTime(int64_t time) { m_queueTime = time; }
+	int64_t QueueTime(void) { return m_queueTime; }
 
 protected:
 
 	cOvgRenderTarget *m_target;
+	int64_t m_queueTime;
 
 private:
 
@@ -777,15 +1129,23 @@ public:
 		cOvgCmd(target) { }
 
 	virtual const char* Description(void) { return "Flush"; }
-#ifdef DEBUG_OVGSTAT
-	virtual bool IsFlush(void) { return true; };
-#endif
+
+	virtual bool Serialize(cOvgStream &s)
+	{
+		s.Put<uint8_t>(cOvgStream::eFlush);
+		s.PutId(m_target);
+		return true;
+	}
+
 	virtual bool Execute(cEgl *egl)
 	{
 		if (!m_target->MakeCurrent(egl))
 			return false;
 
+		// blocks until the GPU has finished the pending drawing operations
+		int64_t start = cTimeUs::Now();
 		eglSwapBuffers(egl->display, m_target->surface);
+		cOvgProfiler::Add("SwapBuffers", cTimeUs::Now() - start);
 		return true;
 	}
 };
@@ -799,6 +1159,13 @@ public:
 
 	virtual const char* Description(void) { return "Reset"; }
 
+	virtual bool Serialize(cOvgStream &s)
+	{
+		s.Put<uint8_t>(cOvgStream::eReset);
+		s.Put<uint8_t>(m_cleanup);
+		return true;
+	}
+
 	virtual bool Execute(cEgl *egl)
 	{
 		if (m_cleanup)
@@ -822,6 +1189,15 @@ public:
 
 	virtual const char* Description(void) { return "CreatePixelBuffer"; }
 
+	virtual bool Serialize(cOvgStream &s)
+	{
+		s.Put<uint8_t>(cOvgStream::eCreatePixelBuffer);
+		s.PutId(m_target);
+		s.Put<int32_t>(m_target->width);
+		s.Put<int32_t>(m_target->height);
+		return true;
+	}
+
 	virtual bool Execute(cEgl *egl)
 	{
 		m_target->image = vgCreateImage(VG_sARGB_8888, m_target->width,
@@ -869,6 +1245,13 @@ public:
 
 	virtual const char* Description(void) { return "DestroySurface"; }
 
+	virtual bool Serialize(cOvgStream &s)
+	{
+		s.Put<uint8_t>(cOvgStream::eDestroySurface);
+		s.PutId(m_target);
+		return true;
+	}
+
 	virtual bool Execute(cEgl *egl)
 	{
 		bool ok = cOvgRenderTarget::MakeDefault(egl);
@@ -900,6 +1283,14 @@ public:
 
 	virtual const char* Description(void) { return "Clear"; }
 
+	virtual bool Serialize(cOvgStream &s)
+	{
+		s.Put<uint8_t>(cOvgStream::eClear);
+		s.PutId(m_target);
+		s.Put<uint32_t>(m_color);
+		return true;
+	}
+
 	virtual bool Execute(cEgl *egl)
 	{
 		if (!m_target->MakeCurrent(egl))
@@ -933,6 +1324,18 @@ public:
 
 	virtual const char* Description(void) { return "SaveRegion"; }
 
+	virtual bool Serialize(cOvgStream &s)
+	{
+		s.Put<uint8_t>(cOvgStream::eSaveRegion);
+		s.PutId(m_target);
+		s.PutId(m_savedRegion);
+		s.Put<int32_t>(m_x);
+		s.Put<int32_t>(m_y);
+		s.Put<int32_t>(m_w);
+		s.Put<int32_t>(m_h);
+		return true;
+	}
+
 	virtual bool Execute(cEgl *egl)
 	{
 		if (!m_target->MakeCurrent(egl))
@@ -978,6 +1381,14 @@ public:
 
 	virtual const char* Description(void) { return "RestoreRegion"; }
 
+	virtual bool Serialize(cOvgStream &s)
+	{
+		s.Put<uint8_t>(cOvgStream::eRestoreRegion);
+		s.PutId(m_target);
+		s.PutId(m_savedRegion);
+		return true;
+	}
+
 	virtual bool Execute(cEgl *egl)
 	{
 		if (!m_target->MakeCurrent(egl))
@@ -1006,6 +1417,13 @@ public:
 
 	virtual const char* Description(void) { return "DropRegion"; }
 
+	virtual bool Serialize(cOvgStream &s)
+	{
+		s.Put<uint8_t>(cOvgStream::eDropRegion);
+		s.PutId(m_savedRegion);
+		return true;
+	}
+
 	virtual bool Execute(cEgl *egl)
 	{
 		if (m_savedRegion)
@@ -1034,6 +1452,17 @@ public:
 
 	virtual const char* Description(void) { return "DrawPixel"; }
 
+	virtual bool Serialize(cOvgStream &s)
+	{
+		s.Put<uint8_t>(cOvgStream::eDrawPixel);
+		s.PutId(m_target);
+		s.Put<int32_t>(m_x);
+		s.Put<int32_t>(m_y);
+		s.Put<uint32_t>(m_color);
+		s.Put<uint8_t>(m_alphablend);
+		return true;
+	}
+
 	virtual bool Execute(cEgl *egl)
 	{
 		if (!m_target->MakeCurrent(egl))
@@ -1070,6 +1499,18 @@ public:
 
 	virtual const char* Description(void) { return "DrawRectangle"; }
 
+	virtual bool Serialize(cOvgStream &s)
+	{
+		s.Put<uint8_t>(cOvgStream::eDrawRectangle);
+		s.PutId(m_target);
+		s.Put<int32_t>(m_x);
+		s.Put<int32_t>(m_y);
+		s.Put<int32_t>(m_w);
+		s.Put<int32_t>(m_h);
+		s.Put<uint32_t>(m_color);
+		return true;
+	}
+
 	virtual bool Execute(cEgl *egl)
 	{
 		if (!m_target->MakeCurrent(egl))
@@ -1107,6 +1548,19 @@ public:
 
 	virtual const char* Description(void) { return "DrawEllipse"; }
 
+	virtual bool Serialize(cOvgStream &s)
+	{
+		s.Put<uint8_t>(cOvgStream::eDrawEllipse);
+		s.PutId(m_target);
+		s.Put<int32_t>(m_x);
+		s.Put<int32_t>(m_y);
+		s.Put<int32_t>(m_w);
+		s.Put<int32_t>(m_h);
+		s.Put<uint32_t>(m_color);
+		s.Put<int32_t>(m_quadrants);
+		return true;
+	}
+
 	virtual bool Execute(cEgl *egl)
 	{
 		if (!m_target->MakeCurrent(egl))
@@ -1145,6 +1599,19 @@ public:
 
 	virtual const char* Description(void) { return "DrawSlope"; }
 
+	virtual bool Serialize(cOvgStream &s)
+	{
+		s.Put<uint8_t>(cOvgStream::eDrawSlope);
+		s.PutId(m_target);
+		s.Put<int32_t>(m_x);
+		s.Put<int32_t>(m_y);
+		s.Put<int32_t>(m_w);
+		s.Put<int32_t>(m_h);
+		s.Put<uint32_t>(m_color);
+		s.Put<int32_t>(m_type);
+		return true;
+	}
+
 	virtual bool Execute(cEgl *egl)
 	{
 		if (!m_target->MakeCurrent(egl))
@@ -1192,6 +1659,27 @@ public:
 
 	virtual const char* Description(void) { return "DrawText"; }
 
+	virtual bool Serialize(cOvgStream &s)
+	{
+		uint32_t len = 0;
+		while (m_symbols[len])
+			len++;
+
+		s.Put<uint8_t>(cOvgStream::eDrawText);
+		s.PutId(m_target);
+		s.Put<int32_t>(m_x);
+		s.Put<int32_t>(m_y);
+		s.PutData(m_symbols, len * sizeof(unsigned int));
+		s.PutData(**m_fontName, strlen(**m_fontName));
+		s.Put<int32_t>(m_fontSize);
+		s.Put<uint32_t>(m_colorFg);
+		s.Put<uint32_t>(m_colorBg);
+		s.Put<int32_t>(m_w);
+		s.Put<int32_t>(m_h);
+		s.Put<int32_t>(m_alignment);
+		return true;
+	}
+
 	virtual bool Execute(cEgl *egl)
 	{
 		if (!m_target->MakeCurrent(egl))
@@ -1311,6 +1799,21 @@ public:
 
 	virtual const char* Description(void) { return "RenderPixels"; }
 
+	virtual bool Serialize(cOvgStream &s)
+	{
+		s.Put<uint8_t>(cOvgStream::eRenderPixels);
+		s.PutId(m_target);
+		s.PutId(m_source);
+		s.Put<int32_t>(m_dx);
+		s.Put<int32_t>(m_dy);
+		s.Put<int32_t>(m_sx);
+		s.Put<int32_t>(m_sy);
+		s.Put<int32_t>(m_w);
+		s.Put<int32_t>(m_h);
+		s.Put<int32_t>(m_alpha);
+		return true;
+	}
+
 	virtual bool Execute(cEgl *egl)
 	{
 		if (!m_target->MakeCurrent(egl))
@@ -1359,6 +1862,21 @@ public:
 
 	virtual const char* Description(void) { return "RenderPattern"; }
 
+	virtual bool Serialize(cOvgStream &s)
+	{
+		s.Put<uint8_t>(cOvgStream::eRenderPattern);
+		s.PutId(m_target);
+		s.PutId(m_source);
+		s.Put<int32_t>(m_dx);
+		s.Put<int32_t>(m_dy);
+		s.Put<int32_t>(m_sx);
+		s.Put<int32_t>(m_sy);
+		s.Put<int32_t>(m_w);
+		s.Put<int32_t>(m_h);
+		s.Put<int32_t>(m_alpha);
+		return true;
+	}
+
 	virtual bool Execute(cEgl *egl)
 	{
 		if (!m_target->MakeCurrent(egl))
@@ -1430,6 +1948,20 @@ public:
 
 	virtual const char* Description(void) { return "CopyPixels"; }
 
+	virtual bool Serialize(cOvgStream &s)
+	{
+		s.Put<uint8_t>(cOvgStream::eCopyPixels);
+		s.PutId(m_target);
+		s.PutId(m_source);
+		s.Put<int32_t>(m_dx);
+		s.Put<int32_t>(m_dy);
+		s.Put<int32_t>(m_sx);
+		s.Put<int32_t>(m_sy);
+		s.Put<int32_t>(m_w);
+		s.Put<int32_t>(m_h);
+		return true;
+	}
+
 	virtual bool Execute(cEgl *egl)
 	{
 		if (!m_target->MakeCurrent(egl))
@@ -1462,6 +1994,19 @@ public:
 
 	virtual const char* Description(void) { return "MovePixels"; }
 
+	virtual bool Serialize(cOvgStream &s)
+	{
+		s.Put<uint8_t>(cOvgStream::eMovePixels);
+		s.PutId(m_target);
+		s.Put<int32_t>(m_dx);
+		s.Put<int32_t>(m_dy);
+		s.Put<int32_t>(m_sx);
+		s.Put<int32_t>(m_sy);
+		s.Put<int32_t>(m_w);
+		s.Put<int32_t>(m_h);
+		return true;
+	}
+
 	virtual bool Execute(cEgl *egl)
 	{
 		if (!m_target->MakeCurrent(egl))
@@ -1496,6 +2041,16 @@ public:
 
 	virtual const char* Description(void) { return "StoreImage"; }
 
+	virtual bool Serialize(cOvgStream &s)
+	{
+		s.Put<uint8_t>(cOvgStream::eStoreImage);
+		s.PutId(m_image);
+		s.Put<int32_t>(m_w);
+		s.Put<int32_t>(m_h);
+		s.PutData(m_argb, m_w * m_h * sizeof(tColor));
+		return true;
+	}
+
 	virtual bool Execute(cEgl *egl)
 	{
 		m_image->image = vgCreateImage(VG_sARGB_8888, m_w, m_h,
@@ -1529,6 +2084,13 @@ public:
 
 	virtual const char* Description(void) { return "DropImage"; }
 
+	virtual bool Serialize(cOvgStream &s)
+	{
+		s.Put<uint8_t>(cOvgStream::eDropImage);
+		s.PutId(m_image);
+		return true;
+	}
+
 	virtual bool Execute(cEgl *egl)
 	{
 		if (m_image->image != VG_INVALID_HANDLE)
@@ -1552,6 +2114,17 @@ public:
 
 	virtual const char* Description(void) { return "DrawImage"; }
 
+	virtual bool Serialize(cOvgStream &s)
+	{
+		// refer to the image by its tOvgImageRef as in StoreImage
+		s.Put<uint8_t>(cOvgStream::eDrawImage);
+		s.PutId(m_target);
+		s.PutId((const char *)m_image - offsetof(tOvgImageRef, image));
+		s.Put<int32_t>(m_x);
+		s.Put<int32_t>(m_y);
+		return true;
+	}
+
 	virtual bool Execute(cEgl *egl)
 	{
 		if (!m_target->MakeCurrent(egl))
@@ -1595,6 +2168,22 @@ public:
 
 	virtual const char* Description(void) { return "DrawBitmap"; }
 
+	virtual bool Serialize(cOvgStream &s)
+	{
+		s.Put<uint8_t>(cOvgStream::eDrawBitmap);
+		s.PutId(m_target);
+		s.Put<int32_t>(m_x);
+		s.Put<int32_t>(m_y);
+		s.Put<int32_t>(m_w);
+		s.Put<int32_t>(m_h);
+		s.PutData(m_argb, m_w * m_h * sizeof(tColor));
+		s.Put<uint8_t>(m_overlay);
+		s.Put<double>(m_scaleX);
+		s.Put<double>(m_scaleY);
+		s.Put<uint8_t>(m_antiAliased);
+		return true;
+	}
+
 	virtual bool Execute(cEgl *egl)
 	{
 		int w = std::min(m_w, vgGeti(VG_MAX_IMAGE_WIDTH));
@@ -1612,40 +2201,182 @@ public:
 				VG_IMAGE_QUALITY_BETTER : VG_IMAGE_QUALITY_NONANTIALIASED);
 		vgSeti(VG_BLEND_MODE, m_overlay ? VG_BLEND_SRC_OVER : VG_BLEND_SRC);
 
-		vgLoadIdentity();
-		vgScale(1.0f, -1.0f);
-		vgTranslate(m_x, m_y - m_target->height);
-		vgScale(m_scaleX, m_scaleY);
+		vgLoadIdentity();
+		vgScale(1.0f, -1.0f);
+		vgTranslate(m_x, m_y - m_target->height);
+		vgScale(m_scaleX, m_scaleY);
+
+		VGImage image = vgCreateImage(VG_sARGB_8888, w, h,
+				VG_IMAGE_QUALITY_BETTER);
+
+		if (image == VG_INVALID_HANDLE)
+		{
+			ELOG("failed to allocate image!");
+			return false;
+		}
+
+		vgImageSubData(image, m_argb, m_w * sizeof(tColor),
+				VG_sARGB_8888, 0, 0, w, h);
+
+		vgDrawImage(image);
+
+		vgDestroyImage(image);
+		return true;
+	}
+
+protected:
+
+	int m_x;
+	int m_y;
+	int m_w;
+	int m_h;
+	tColor *m_argb;
+	bool m_overlay;
+	double m_scaleX;
+	double m_scaleY;
+	bool m_antiAliased;
+};
+
+class cOvgCmdDrawOverlay : public cOvgCmd
+{
+public:
+
+	cOvgCmdDrawOverlay(cOvgOverlay *overlay, const std::vector<cString> &lines,
+			cString *fontName, int fontSize) :
+		cOvgCmd(overlay), m_overlay(overlay), m_lines(lines),
+		m_fontName(fontName), m_fontSize(fontSize) { }
+
+	virtual ~cOvgCmdDrawOverlay()
+	{
+		delete m_fontName;
+	}
+
+	virtual const char* Description(void) { return "DrawOverlay"; }
+
+	virtual bool Execute(cEgl *egl)
+	{
+		int lineHeight = m_fontSize * 5 / 4;
+		int border = m_fontSize / 2;
+
+		// don't reset the OSD if the overlay can't be shown
+		if (!m_overlay->Open(egl, m_fontSize * 20,
+				m_lines.size() * lineHeight + 2 * border))
+			return true;
+
+		cOvgCmdClear clear(m_overlay, 0xc0000000);
+		if (!clear.Execute(egl))
+			return false;
+
+		for (unsigned int i = 0; i < m_lines.size(); i++)
+		{
+			int len = Utf8StrLen(m_lines[i]);
+			unsigned int *symbols = MALLOC(unsigned int, len + 1);
+			if (!symbols)
+				break;
+
+			Utf8ToArray(m_lines[i], symbols, len + 1);
+			cOvgCmdDrawText text(m_overlay, border, border + i * lineHeight,
+					symbols, new cString(*m_fontName), m_fontSize,
+					clrWhite, clrTransparent, 0, 0, taDefault);
+			if (!text.Execute(egl))
+				return false;
+		}
+
+		cOvgCmdFlush flush(m_overlay);
+		return flush.Execute(egl);
+	}
+
+private:
+
+	cOvgOverlay *m_overlay;
+	std::vector<cString> m_lines;
+	cString *m_fontName;
+	int m_fontSize;
+};
+
+class cOvgCmdCloseOverlay : public cOvgCmd
+{
+public:
+
+	cOvgCmdCloseOverlay(cOvgOverlay *overlay) :
+		cOvgCmd(overlay), m_overlay(overlay) { }
+
+	virtual const char* Description(void) { return "CloseOverlay"; }
+
+	virtual bool Execute(cEgl *egl)
+	{
+		m_overlay->Close(egl);
+		return true;
+	}
+
+private:
+
+	cOvgOverlay *m_overlay;
+};
+
+/* ------------------------------------------------------------------------- */
+
+// file format: magic, followed by records of payload size (uint32_t), time
+// since start of recording in us (int64_t) and the serialized command
 
-		VGImage image = vgCreateImage(VG_sARGB_8888, w, h,
-				VG_IMAGE_QUALITY_BETTER);
+#define OVG_RECORD_MAGIC "OVGREC01"
+#define OVG_RECORD_MAX_SIZE (64 * 1024 * 1024)
 
-		if (image == VG_INVALID_HANDLE)
+class cOvgRecorder
+{
+public:
+
+	static cOvgRecorder *Create(const char *fileName)
+	{
+		FILE *f = fopen(fileName, "w");
+		if (!f)
 		{
-			ELOG("failed to allocate image!");
-			return false;
+			ELOG("failed to open %s for recording OSD commands!", fileName);
+			return 0;
 		}
+		fwrite(OVG_RECORD_MAGIC, strlen(OVG_RECORD_MAGIC), 1, f);
+		return new cOvgRecorder(f, fileName);
+	}
 
-		vgImageSubData(image, m_argb, m_w * sizeof(tColor),
-				VG_sARGB_8888, 0, 0, w, h);
+	~cOvgRecorder()
+	{
+		bool error = ferror(m_file);
+		if (fclose(m_file) || error)
+			ELOG("failed to write OSD commands to %s!", *m_fileName);
+		else
+			DLOG("recorded %d OSD commands to %s", m_count, *m_fileName);
+	}
 
-		vgDrawImage(image);
+	void Record(cOvgCmd *cmd)
+	{
+		// skip commands which have been queued before recording started
+		int64_t time = cmd->QueueTime() - m_start;
+		if (time < 0)
+			return;
 
-		vgDestroyImage(image);
-		return true;
+		cOvgStream s;
+		if (!cmd->Serialize(s))
+			return;
+
+		uint32_t size = s.Data().size();
+		fwrite(&size, sizeof(size), 1, m_file);
+		fwrite(&time, sizeof(time), 1, m_file);
+		fwrite(s.Data().data(), size, 1, m_file);
+		m_count++;
 	}
 
-protected:
+	int Count(void) const { return m_count; }
 
-	int m_x;
-	int m_y;
-	int m_w;
-	int m_h;
-	tColor *m_argb;
-	bool m_overlay;
-	double m_scaleX;
-	double m_scaleY;
-	bool m_antiAliased;
+private:
+
+	cOvgRecorder(FILE *file, const char *fileName) :
+		m_file(file), m_fileName(fileName), m_start(cTimeUs::Now()),
+		m_count(0) { }
+
+	FILE    *m_file;
+	cString  m_fileName;
+	int64_t  m_start;
+	int      m_count;
 };
 
 /* ------------------------------------------------------------------------- */
@@ -1657,7 +2388,8 @@ class cOvgThread : public cThread
 {
 public:
 
-	cOvgThread(int layer) :	cThread("ovgthread"), m_layer(layer)
+	cOvgThread(int layer) :	cThread("ovgthread"), m_layer(layer),
+		m_overlay(layer + 1), m_executed(0), m_recorder(0)
 	{
 		for (int i = 0; i < OVG_MAX_OSDIMAGES; i++)
 			m_images[i].used = false;
@@ -1681,6 +2413,8 @@ public:
 
 		while (Active())
 			cCondWait::SleepMs(2);
+
+		delete m_recorder;
 	}
 
 	void DoCmd(cOvgCmd* cmd)
@@ -1690,6 +2424,7 @@ public:
 			m_commandsFull.Wait(m_commandsMutex);
 		if (m_commands.empty())
 			m_commandsEmpty.Broadcast();
+		cmd->SetQueueTime(cTimeUs::Now());
 		m_commands.emplace(cmd);
 		m_commandsMutex.Unlock();
 	}
@@ -1781,6 +2516,42 @@ public:
 		return 0;
 	}
 
+	cOvgOverlay *Overlay(void)
+	{
+		return &m_overlay;
+	}
+
+	unsigned int ExecutedCommands(void) const
+	{
+		return m_executed.load(std::memory_order_relaxed);
+	}
+
+	bool StartRecording(const char *fileName)
+	{
+		cOvgRecorder *recorder = cOvgRecorder::Create(fileName);
+		if (!recorder)
+			return false;
+
+		m_recorderMutex.Lock();
+		delete m_recorder;
+		m_recorder = recorder;
+		m_recorderMutex.Unlock();
+		return true;
+	}
+
+	// returns the number of recorded commands or -1 if not recording
+	int StopRecording(void)
+	{
+		m_recorderMutex.Lock();
+		cOvgRecorder *recorder = m_recorder;
+		m_recorder = 0;
+		m_recorderMutex.Unlock();
+
+		int ret = recorder ? recorder->Count() : -1;
+		delete recorder;
+		return ret;
+	}
+
 protected:
 
 	virtual int GetFreeImageHandle(void)
@@ -1890,11 +2661,6 @@ protected:
 			m_maxImageSize.Set(vgGeti(VG_MAX_IMAGE_WIDTH),
 					   vgGeti(VG_MAX_IMAGE_HEIGHT));
 
-#ifdef DEBUG_OVGSTAT
-			cTimeMs timer;
-			int commands = 0, flushes = 0;
-#endif
-
 			for (;;)
 			{
 				m_commandsLoop.Broadcast();
@@ -1909,23 +2675,20 @@ protected:
 					m_commands.pop();
 					m_commandsMutex.Unlock();
 
-#ifdef DEBUG_OVGSTAT
-					if (timer.TimedOut())
-					{
-						if (commands || flushes)
-						{
-							DLOG("[OpenVG] commands executed: %d, flushes: %d",
-									commands, flushes);
-							commands = 0;
-							flushes = 0;
-						}
-						timer.Set(1000);
-					}
-					commands++;
-					if (cmd->IsFlush())
-						flushes++;
-#endif
+					// record on this thread to keep large commands from
+					// blocking the queue
+					m_recorderMutex.Lock();
+					if (m_recorder)
+						m_recorder->Record(cmd);
+					m_recorderMutex.Unlock();
+
+					int64_t start = cTimeUs::Now();
+					cOvgProfiler::Add("QueueWait", start - cmd->QueueTime());
+
 					bool reset = !cmd->Execute(&egl);
+					m_executed.fetch_add(1, std::memory_order_relaxed);
+					cOvgProfiler::Add(cmd->Description(),
+							cTimeUs::Now() - start);
 
 					VGErrorCode err = vgGetError();
 					if (err != VG_NO_ERROR)
@@ -1943,6 +2706,9 @@ protected:
 			}
 			m_commandsMutex.Unlock();
 
+			// overlay gets recreated with the next update
+			m_overlay.Close(&egl);
+
 			if (eglMakeCurrent(egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE,
 					EGL_NO_CONTEXT) == EGL_FALSE)
 				ELOG("[EGL] failed to release active surface from context: %s!",
@@ -2000,6 +2766,11 @@ private:
 	cCondWait *m_wait;
 	int m_layer;
 
+	cOvgOverlay m_overlay;
+	std::atomic<unsigned int> m_executed;
+	cOvgRecorder *m_recorder;
+	cMutex m_recorderMutex;
+
 	tOvgImageRef m_images[OVG_MAX_OSDIMAGES];
 
 	cSize m_maxImageSize;
@@ -2007,6 +2778,516 @@ private:
 
 /* ------------------------------------------------------------------------- */
 
+#define OVG_PERF_OVERLAY_INTERVAL 1000
+
+static void (*s_onGetStats)(void*, tPipelineStats&) = 0;
+static void *s_onGetStatsData = 0;
+static cMutex s_statsMutex;
+static cMutex s_perfOverlayMutex;
+
+class cOvgPerfOverlay : public cThread
+{
+public:
+
+	cOvgPerfOverlay(cOvgThread *ovg) : cThread("perf overlay"), m_ovg(ovg),
+		// fonts are replaced on the main thread, so don't touch them later
+		m_fontName(cFont::GetFont(fontFix)->FontName())
+	{
+		Start();
+	}
+
+	virtual ~cOvgPerfOverlay()
+	{
+		Cancel(-1);
+		m_wait.Signal();
+		while (Active())
+			cCondWait::SleepMs(2);
+
+		m_ovg->DoCmd(new cOvgCmdCloseOverlay(m_ovg->Overlay()));
+	}
+
+protected:
+
+	virtual void Action(void)
+	{
+		DLOG("cOvgPerfOverlay() thread started");
+
+		tPipelineStats last;
+		memset(&last, 0, sizeof(last));
+		unsigned int lastCommands = m_ovg->ExecutedCommands();
+		int64_t lastTime = cTimeUs::Now();
+
+		while (Running())
+		{
+			m_wait.Wait(OVG_PERF_OVERLAY_INTERVAL);
+			if (!Running())
+				break;
+
+			tPipelineStats stats;
+			memset(&stats, 0, sizeof(stats));
+
+			s_statsMutex.Lock();
+			if (s_onGetStats)
+				s_onGetStats(s_onGetStatsData, stats);
+			s_statsMutex.Unlock();
+
+			unsigned int commands = m_ovg->ExecutedCommands();
+			int64_t now = cTimeUs::Now();
+			double elapsed = (now - lastTime) / 1000000.0;
+
+			// port counters restart after a codec change or flush
+			unsigned int decoded = stats.decodedFrames >= last.decodedFrames ?
+					stats.decodedFrames - last.decodedFrames : stats.decodedFrames;
+			unsigned int dropped = stats.droppedFrames >= last.droppedFrames ?
+					stats.droppedFrames - last.droppedFrames : stats.droppedFrames;
+			int64_t cpu = stats.audioCpuTimeUs >= last.audioCpuTimeUs ?
+					stats.audioCpuTimeUs - last.audioCpuTimeUs : 0;
+
+			std::vector<cString> lines;
+			lines.push_back(cString::sprintf("audio: %3d%% %6d ms%s",
+					stats.audioBuffer, stats.audioBufferedMs,
+					stats.hasAudio ? "" : " (none)"));
+			lines.push_back(cString::sprintf("audio staged: %d/%d ms",
+					stats.audioStagedMs, stats.audioLatencyTargetMs));
+			lines.push_back(cString::sprintf("video: %3d%% %6d ms%s",
+					stats.videoBuffer, stats.videoBufferedMs,
+					stats.hasVideo ? "" : " (none)"));
+			lines.push_back(cString::sprintf("A/V offset: %+d ms",
+					stats.avOffsetMs));
+			lines.push_back(cString::sprintf("decoded: %.1f fps, dropped: %u",
+					decoded / elapsed, dropped));
+			lines.push_back(cString::sprintf("live speed: %+d",
+					stats.liveSpeed));
+			lines.push_back(cString::sprintf("OSD commands: %.0f/s",
+					(commands - lastCommands) / elapsed));
+			lines.push_back(cString::sprintf("audio decoder CPU: %.1f%%",
+					cpu / 10000.0 / elapsed));
+
+			int width, height;
+			cRpiDisplay::GetSize(width, height);
+			m_ovg->DoCmd(new cOvgCmdDrawOverlay(m_ovg->Overlay(), lines,
+					new cString(m_fontName),
+					std::max(height / 40, 12)));
+
+			last = stats;
+			lastCommands = commands;
+			lastTime = now;
+		}
+
+		DLOG("cOvgPerfOverlay() thread ended");
+	}
+
+private:
+
+	cOvgThread *m_ovg;
+	cString m_fontName;
+	cCondWait m_wait;
+};
+
+/* ------------------------------------------------------------------------- */
+
+class cOvgReplayer : public cThread
+{
+public:
+
+	cOvgReplayer(cOvgThread *ovg, const char *fileName, bool timed) :
+		cThread("ovg replayer"), m_ovg(ovg), m_fileName(fileName),
+		m_timed(timed)
+	{
+		Start();
+	}
+
+	virtual ~cOvgReplayer()
+	{
+		Cancel(-1);
+		m_wait.Signal();
+		while (Active())
+			cCondWait::SleepMs(2);
+	}
+
+protected:
+
+	virtual void Action(void)
+	{
+		FILE *f = fopen(m_fileName, "r");
+		if (!f)
+		{
+			ELOG("failed to open %s for replaying OSD commands!", *m_fileName);
+			return;
+		}
+
+		char magic[sizeof(OVG_RECORD_MAGIC) - 1];
+		if (fread(magic, sizeof(magic), 1, f) != 1 ||
+				memcmp(magic, OVG_RECORD_MAGIC, sizeof(magic)))
+		{
+			ELOG("%s is no OSD command recording!", *m_fileName);
+			fclose(f);
+			return;
+		}
+
+		DLOG("replaying OSD commands from %s", *m_fileName);
+		int64_t start = cTimeUs::Now();
+		int count = 0;
+		std::vector<char> buf;
+
+		while (Running())
+		{
+			uint32_t size;
+			int64_t time;
+			if (fread(&size, sizeof(size), 1, f) != 1 ||
+					fread(&time, sizeof(time), 1, f) != 1)
+				break;
+
+			if (size > OVG_RECORD_MAX_SIZE)
+			{
+				ELOG("invalid OSD command size in recording!");
+				break;
+			}
+			buf.resize(size);
+			if (size && fread(&buf[0], size, 1, f) != 1)
+			{
+				ELOG("truncated OSD command recording!");
+				break;
+			}
+
+			// keep the original pace unless replaying as fast as possible
+			int64_t delay = time - (cTimeUs::Now() - start);
+			if (m_timed && delay > 1000)
+				m_wait.Wait(delay / 1000);
+
+			cOvgStream stream(size ? &buf[0] : 0, size);
+			cOvgCmd *cmd = 0;
+			if (!Parse(stream, cmd))
+			{
+				ELOG("invalid OSD command in recording!");
+				break;
+			}
+			if (cmd)
+				m_ovg->DoCmd(cmd);
+			count++;
+		}
+		fclose(f);
+
+		CleanUp();
+		DLOG("replayed %d OSD commands in %.1fms", count,
+				(cTimeUs::Now() - start) / 1000.0);
+	}
+
+private:
+
+	cOvgRenderTarget *Target(uint64_t id)
+	{
+		// targets not created by the recording are window surfaces
+		std::map<uint64_t, cOvgRenderTarget*>::iterator it = m_targets.find(id);
+		if (it != m_targets.end())
+			return it->second;
+
+		return m_targets[id] = new cOvgRenderTarget();
+	}
+
+	cOvgSavedRegion *Region(uint64_t id)
+	{
+		std::map<uint64_t, cOvgSavedRegion*>::iterator it = m_regions.find(id);
+		if (it != m_regions.end())
+			return it->second;
+
+		return m_regions[id] = new cOvgSavedRegion();
+	}
+
+	tOvgImageRef *Image(uint64_t id)
+	{
+		std::map<uint64_t, int>::iterator it = m_images.find(id);
+		return it != m_images.end() ? m_ovg->GetImageRef(it->second) : 0;
+	}
+
+	// parameters are read into variables first, since the evaluation order
+	// of function arguments is unspecified
+	bool Parse(cOvgStream &s, cOvgCmd *&cmd)
+	{
+		uint8_t type = s.Get<uint8_t>();
+		switch (type)
+		{
+		case cOvgStream::eFlush:
+		{
+			uint64_t target = s.GetId();
+			cmd = new cOvgCmdFlush(Target(target));
+			break;
+		}
+		case cOvgStream::eReset:
+		{
+			bool cleanup = s.Get<uint8_t>();
+			cmd = new cOvgCmdReset(cleanup);
+			break;
+		}
+		case cOvgStream::eCreatePixelBuffer:
+		{
+			uint64_t target = s.GetId();
+			int w = s.Get<int32_t>();
+			int h = s.Get<int32_t>();
+			if (s.Error())
+				break;
+			m_targets[target] = new cOvgRenderTarget(w, h);
+			cmd = new cOvgCmdCreatePixelBuffer(m_targets[target]);
+			break;
+		}
+		case cOvgStream::eDestroySurface:
+		{
+			// the command clears the pointer it gets passed by reference
+			uint64_t target = s.GetId();
+			m_destroyed.push_back(Target(target));
+			m_targets.erase(target);
+			cmd = new cOvgCmdDestroySurface(m_destroyed.back());
+			break;
+		}
+		case cOvgStream::eClear:
+		{
+			uint64_t target = s.GetId();
+			tColor color = s.Get<uint32_t>();
+			cmd = new cOvgCmdClear(Target(target), color);
+			break;
+		}
+		case cOvgStream::eSaveRegion:
+		{
+			uint64_t target = s.GetId();
+			uint64_t region = s.GetId();
+			int x = s.Get<int32_t>();
+			int y = s.Get<int32_t>();
+			int w = s.Get<int32_t>();
+			int h = s.Get<int32_t>();
+			cmd = new cOvgCmdSaveRegion(Target(target), Region(region),
+					x, y, w, h);
+			break;
+		}
+		case cOvgStream::eRestoreRegion:
+		{
+			uint64_t target = s.GetId();
+			uint64_t region = s.GetId();
+			cmd = new cOvgCmdRestoreRegion(Target(target), Region(region));
+			break;
+		}
+		case cOvgStream::eDropRegion:
+		{
+			uint64_t region = s.GetId();
+			cmd = new cOvgCmdDropRegion(Region(region));
+			m_regions.erase(region);
+			break;
+		}
+		case cOvgStream::eDrawPixel:
+		{
+			uint64_t target = s.GetId();
+			int x = s.Get<int32_t>();
+			int y = s.Get<int32_t>();
+			tColor color = s.Get<uint32_t>();
+			bool alphablend = s.Get<uint8_t>();
+			cmd = new cOvgCmdDrawPixel(Target(target), x, y, color, alphablend);
+			break;
+		}
+		case cOvgStream::eDrawRectangle:
+		case cOvgStream::eDrawEllipse:
+		case cOvgStream::eDrawSlope:
+		{
+			uint64_t target = s.GetId();
+			int x = s.Get<int32_t>();
+			int y = s.Get<int32_t>();
+			int w = s.Get<int32_t>();
+			int h = s.Get<int32_t>();
+			tColor color = s.Get<uint32_t>();
+			if (type == cOvgStream::eDrawRectangle)
+				cmd = new cOvgCmdDrawRectangle(Target(target),
+						x, y, w, h, color);
+			else if (type == cOvgStream::eDrawEllipse)
+				cmd = new cOvgCmdDrawEllipse(Target(target),
+						x, y, w, h, color, s.Get<int32_t>());
+			else
+				cmd = new cOvgCmdDrawSlope(Target(target),
+						x, y, w, h, color, s.Get<int32_t>());
+			break;
+		}
+		case cOvgStream::eDrawText:
+		{
+			uint64_t target = s.GetId();
+			int x = s.Get<int32_t>();
+			int y = s.Get<int32_t>();
+			uint32_t size;
+			unsigned int *symbols = (unsigned int *)s.GetData(size);
+			char *fontName = (char *)s.GetData(size);
+			int fontSize = s.Get<int32_t>();
+			tColor colorFg = s.Get<uint32_t>();
+			tColor colorBg = s.Get<uint32_t>();
+			int w = s.Get<int32_t>();
+			int h = s.Get<int32_t>();
+			int alignment = s.Get<int32_t>();
+			if (!symbols || !fontName || s.Error())
+			{
+				free(symbols);
+				free(fontName);
+				break;
+			}
+			cmd = new cOvgCmdDrawText(Target(target), x, y, symbols,
+					new cString(fontName, true), fontSize, colorFg, colorBg,
+					w, h, alignment);
+			break;
+		}
+		case cOvgStream::eRenderPixels:
+		case cOvgStream::eRenderPattern:
+		{
+			uint64_t target = s.GetId();
+			uint64_t source = s.GetId();
+			int dx = s.Get<int32_t>();
+			int dy = s.Get<int32_t>();
+			int sx = s.Get<int32_t>();
+			int sy = s.Get<int32_t>();
+			int w = s.Get<int32_t>();
+			int h = s.Get<int32_t>();
+			int alpha = s.Get<int32_t>();
+			if (type == cOvgStream::eRenderPixels)
+				cmd = new cOvgCmdRenderPixels(Target(target), Target(source),
+						dx, dy, sx, sy, w, h, alpha);
+			else
+				cmd = new cOvgCmdRenderPattern(Target(target), Target(source),
+						dx, dy, sx, sy, w, h, alpha);
+			break;
+		}
+		case cOvgStream::eCopyPixels:
+		{
+			uint64_t target = s.GetId();
+			uint64_t source = s.GetId();
+			int dx = s.Get<int32_t>();
+			int dy = s.Get<int32_t>();
+			int sx = s.Get<int32_t>();
+			int sy = s.Get<int32_t>();
+			int w = s.Get<int32_t>();
+			int h = s.Get<int32_t>();
+			cmd = new cOvgCmdCopyPixels(Target(target), Target(source),
+					dx, dy, sx, sy, w, h);
+			break;
+		}
+		case cOvgStream::eMovePixels:
+		{
+			uint64_t target = s.GetId();
+			int dx = s.Get<int32_t>();
+			int dy = s.Get<int32_t>();
+			int sx = s.Get<int32_t>();
+			int sy = s.Get<int32_t>();
+			int w = s.Get<int32_t>();
+			int h = s.Get<int32_t>();
+			cmd = new cOvgCmdMovePixels(Target(target), dx, dy, sx, sy, w, h);
+			break;
+		}
+		case cOvgStream::eStoreImage:
+		{
+			// store synchronously as cOvgThread does to get a valid handle
+			uint64_t image = s.GetId();
+			int w = s.Get<int32_t>();
+			int h = s.Get<int32_t>();
+			uint32_t size;
+			tColor *argb = (tColor *)s.GetData(size);
+			if (argb && !s.Error() && size == w * h * sizeof(tColor))
+			{
+				int handle = m_ovg->StoreImageData(
+						cImage(cSize(w, h), argb));
+				if (handle)
+					m_images[image] = handle;
+			}
+			free(argb);
+			return !s.Error();
+		}
+		case cOvgStream::eDropImage:
+		{
+			uint64_t image = s.GetId();
+			std::map<uint64_t, int>::iterator it = m_images.find(image);
+			if (it != m_images.end())
+			{
+				m_ovg->DropImageData(it->second);
+				m_images.erase(it);
+			}
+			return !s.Error();
+		}
+		case cOvgStream::eDrawImage:
+		{
+			uint64_t target = s.GetId();
+			tOvgImageRef *image = Image(s.GetId());
+			int x = s.Get<int32_t>();
+			int y = s.Get<int32_t>();
+			if (image)
+				cmd = new cOvgCmdDrawImage(Target(target), &image->image, x, y);
+			return !s.Error();
+		}
+		case cOvgStream::eDrawBitmap:
+		{
+			uint64_t target = s.GetId();
+			int x = s.Get<int32_t>();
+			int y = s.Get<int32_t>();
+			int w = s.Get<int32_t>();
+			int h = s.Get<int32_t>();
+			uint32_t size;
+			tColor *argb = (tColor *)s.GetData(size);
+			bool overlay = s.Get<uint8_t>();
+			double scaleX = s.Get<double>();
+			double scaleY = s.Get<double>();
+			bool antiAliased = s.Get<uint8_t>();
+			if (!argb || s.Error() || size != w * h * sizeof(tColor))
+			{
+				free(argb);
+				break;
+			}
+			cmd = new cOvgCmdDrawBitmap(Target(target), x, y, w, h, argb,
+					overlay, scaleX, scaleY, antiAliased);
+			break;
+		}
+		default:
+			return false;
+		}
+
+		if (cmd && s.Error())
+		{
+			delete cmd;
+			cmd = 0;
+		}
+		return cmd != 0;
+	}
+
+	void CleanUp(void)
+	{
+		for (std::map<uint64_t, cOvgSavedRegion*>::iterator it =
+				m_regions.begin(); it != m_regions.end(); ++it)
+			m_ovg->DoCmd(new cOvgCmdDropRegion(it->second));
+		m_regions.clear();
+
+		for (std::map<uint64_t, int>::iterator it = m_images.begin();
+				it != m_images.end(); ++it)
+			m_ovg->DropImageData(it->second);
+		m_images.clear();
+
+		for (std::map<uint64_t, cOvgRenderTarget*>::iterator it =
+				m_targets.begin(); it != m_targets.end(); ++it)
+			m_destroyed.push_back(it->second);
+		m_targets.clear();
+
+		// DestroySurface() waits for its command, which is queued last, so
+		// all pending references to m_destroyed are gone afterwards
+		m_destroyed.push_back(new cOvgRenderTarget());
+		m_ovg->DestroySurface(m_destroyed.back());
+		for (std::list<cOvgRenderTarget*>::iterator it = m_destroyed.begin();
+				it != m_destroyed.end(); ++it)
+			if (*it)
+				m_ovg->DestroySurface(*it);
+		m_destroyed.clear();
+	}
+
+	cOvgThread *m_ovg;
+	cString     m_fileName;
+	bool        m_timed;
+	cCondWait   m_wait;
+
+	std::map<uint64_t, cOvgRenderTarget*> m_targets;
+	std::map<uint64_t, cOvgSavedRegion*>  m_regions;
+	std::map<uint64_t, int>               m_images;
+	std::list<cOvgRenderTarget*>          m_destroyed;
+};
+
+/* ------------------------------------------------------------------------- */
+
 class cOvgPixmap : public cPixmap
 {
 public:
@@ -2767,16 +4048,27 @@ private:
 /* ------------------------------------------------------------------------- */
 
 cOvgThread* cRpiOsdProvider::s_ovg;
+cOvgPerfOverlay* cRpiOsdProvider::s_perfOverlay;
+cOvgReplayer* cRpiOsdProvider::s_replayer;
 
 cRpiOsdProvider::cRpiOsdProvider(int layer) : cOsdProvider()
 {
 	DLOG("new cOsdProvider()");
 	s_ovg = new cOvgThread(layer);
+	UpdatePerfOverlay();
 }
 
 cRpiOsdProvider::~cRpiOsdProvider()
 {
 	DLOG("delete cOsdProvider()");
+	s_perfOverlayMutex.Lock();
+	delete s_perfOverlay;
+	s_perfOverlay = NULL;
+	s_perfOverlayMutex.Unlock();
+
+	delete s_replayer;
+	s_replayer = NULL;
+
 	cOvgThread* ovg = s_ovg;
 	s_ovg = NULL;
 	delete ovg;
@@ -2814,5 +4106,61 @@ void cRpiOsdProvider::ResetOsd(bool cleanup)
 	if (s_ovg)
 		s_ovg->DoCmd(new cOvgCmdReset(cleanup));
 
+	UpdatePerfOverlay();
 	UpdateOsdSize(true);
 }
+
+cString cRpiOsdProvider::GetProfile(bool histogram)
+{
+	return cOvgProfiler::Dump(histogram);
+}
+
+void cRpiOsdProvider::ClearProfile(void)
+{
+	cOvgProfiler::Clear();
+}
+
+bool cRpiOsdProvider::StartRecording(const char *fileName)
+{
+	return s_ovg && s_ovg->StartRecording(fileName);
+}
+
+int cRpiOsdProvider::StopRecording(void)
+{
+	return s_ovg ? s_ovg->StopRecording() : -1;
+}
+
+bool cRpiOsdProvider::Replay(const char *fileName, bool timed)
+{
+	if (!s_ovg || (s_replayer && s_replayer->Active()))
+		return false;
+
+	delete s_replayer;
+	s_replayer = new cOvgReplayer(s_ovg, fileName, timed);
+	return true;
+}
+
+void cRpiOsdProvider::SetStatsCallback(
+		void (*onGetStats)(void*, tPipelineStats&), void *data)
+{
+	s_statsMutex.Lock();
+	s_onGetStats = onGetStats;
+	s_onGetStatsData = data;
+	s_statsMutex.Unlock();
+}
+
+void cRpiOsdProvider::UpdatePerfOverlay(void)
+{
+	s_perfOverlayMutex.Lock();
+	if (s_ovg && cRpiSetup::IsPerfOverlay())
+	{
+		if (!s_perfOverlay)
+			s_perfOverlay = new cOvgPerfOverlay(s_ovg);
+	}
+	else
+	{
+		delete s_perfOverlay;
+		s_perfOverlay = NULL;
+	}
+	s_perfOverlayMutex.Unlock();
+}
@@ -23,6 +23,9 @@
 #include <vdr/osd.h>
 
 class cOvgThread;
+class cOvgPerfOverlay;
+class cOvgReplayer;
+struct tPipelineStats;
 
 class cRpiOsdProvider : public cOsdProvider
 {
@@ -35,6 +38,16 @@ public:
 	static void ResetOsd(bool cleanup = false);
 	static const cImage *GetImageData(int ImageHandle);
 
+	static cString GetProfile(bool histogram = false);
+	static void ClearProfile(void);
+
+	static bool StartRecording(const char *fileName);
+	static int StopRecording(void);
+	static bool Replay(const char *fileName, bool timed = true);
+
+	static void SetStatsCallback(
+			void (*onGetStats)(void*, tPipelineStats&), void *data = 0);
+
 protected:
 
 	virtual cOsd *CreateOsd(int Left, int Top, uint Level);
@@ -43,7 +56,12 @@ protected:
 	virtual void DropImageData(int ImageHandle);
 
 private:
+
+	static void UpdatePerfOverlay(void);
+
 	static cOvgThread *s_ovg;
+	static cOvgPerfOverlay *s_perfOverlay;
+	static cOvgReplayer *s_replayer;
 };
 
 #endif
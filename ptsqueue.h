@@ -0,0 +1,106 @@
+/*
+ * rpihddevice - VDR HD output device for Raspberry Pi
+ * Copyright (C) 2014, 2015, 2016 Thomas Reufer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef PTS_QUEUE_H
+#define PTS_QUEUE_H
+
+#include <stdint.h>
+
+// ring of the time stamps of pending PES data. Each PES is identified by the
+// stream offset of its end, counted in bytes since the last reset, so no
+// lengths need to be updated while consuming. size must be a power of two
+
+template<unsigned int size, int64_t invalidPts>
+class cPtsQueue
+{
+public:
+
+	struct Pts
+	{
+		int64_t 		pts;
+		uint64_t 		end;
+		int64_t 		time;
+	};
+
+	cPtsQueue() : m_head(0), m_count(0), m_appended(0), m_consumed(0) { }
+
+	bool empty() const { return !m_count; }
+	bool full() const { return m_count == size; }
+	Pts& front() { return m_ring[m_head]; }
+	uint64_t consumed() const { return m_consumed; }
+
+	void push(int64_t pts, unsigned int length, int64_t time)
+	{
+		m_appended += length;
+		Pts &p = m_ring[(m_head + m_count++) & (size - 1)];
+		p.pts = pts;
+		p.end = m_appended;
+		p.time = time;
+	}
+
+	void pop()
+	{
+		m_head = (m_head + 1) & (size - 1);
+		m_count--;
+	}
+
+	// drops the time stamps of all PES which have been consumed completely.
+	// A partially consumed PES loses its PTS, since it's not valid anymore
+	// for the remaining data, unless only garbage in front of it is skipped
+	void consume(unsigned int length, bool retainPts)
+	{
+		m_consumed += length;
+		while (m_count)
+		{
+			Pts& p = front();
+			if (p.end <= m_consumed)
+			{
+				bool done = p.end == m_consumed;
+				pop();
+				if (done)
+					break;
+			}
+			else
+			{
+				if (!retainPts)
+					p.pts = invalidPts;
+
+				break;
+			}
+		}
+	}
+
+	void clear()
+	{
+		m_head = 0;
+		m_count = 0;
+		m_appended = 0;
+		m_consumed = 0;
+	}
+
+private:
+
+	Pts          m_ring[size];
+	unsigned int m_head;
+	unsigned int m_count;
+	uint64_t     m_appended;
+	uint64_t     m_consumed;
+};
+
+#endif
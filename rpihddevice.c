@@ -25,6 +25,7 @@
 #include "setup.h"
 #include "display.h"
 #include "tools.h"
+#include "trace.h"
 
 static const char *VERSION        = "1.0.6";
 static const char *DESCRIPTION    = trNOOP("HD output device for Raspberry Pi");
@@ -56,6 +57,9 @@ public:
 	virtual cOsdObject *MainMenuAction(void) { return NULL; }
 	virtual cMenuSetupPage *SetupMenu(void);
 	virtual bool SetupParse(const char *Name, const char *Value);
+	virtual const char **SVDRPHelpPages(void);
+	virtual cString SVDRPCommand(const char *Command, const char *Option,
+			int &ReplyCode);
 };
 
 cPluginRpiHdDevice::cPluginRpiHdDevice(void) :
@@ -116,4 +120,152 @@ const char *cPluginRpiHdDevice::CommandLineHelp(void)
 	return cRpiSetup::GetInstance()->CommandLineHelp();
 }
 
+const char **cPluginRpiHdDevice::SVDRPHelpPages(void)
+{
+	static const char *HelpPages[] = {
+		"TRACE [ CLEAR ]\n"
+		"    Print the recorded pipeline events, one per line: time since\n"
+		"    the oldest event and since the previous event in ms, thread id,\n"
+		"    event name and event data. CLEAR discards all recorded events.",
+		"TRACEJSON <file>\n"
+		"    Write the recorded pipeline events to <file> in Chrome's trace\n"
+		"    event format, to be loaded with chrome://tracing or Perfetto.",
+		"OVGSTAT [ HIST | CLEAR ]\n"
+		"    Print the execution time of the OSD commands by type, the time\n"
+		"    commands spent in the queue (QueueWait) and the time needed to\n"
+		"    swap buffers (SwapBuffers). HIST prints the histogram buckets,\n"
+		"    where bucket n counts the samples below 2^n us. CLEAR resets\n"
+		"    all statistics.",
+		"AUDIOSTAT [ CLEAR ]\n"
+		"    Print the CPU load of the audio decoder thread and the time per\n"
+		"    frame spent for parsing, decoding, resampling, submitting to OMX\n"
+		"    and waiting in the parser: count, mean, moving average, maximum\n"
+		"    within the last second and overall maximum. CLEAR resets them.",
+		"OVGREC <file> | STOP\n"
+		"    Record all OSD commands including image data and font names to\n"
+		"    <file>. STOP ends the recording.",
+		"OVGPLAY <file> [ FAST ]\n"
+		"    Replay recorded OSD commands from <file> with their original\n"
+		"    timing, or as fast as possible with FAST.",
+		NULL
+	};
+	return HelpPages;
+}
+
+cString cPluginRpiHdDevice::SVDRPCommand(const char *Command,
+		const char *Option, int &ReplyCode)
+{
+	if (!strcasecmp(Command, "TRACE"))
+	{
+		if (!strcasecmp(Option, "CLEAR"))
+		{
+			cRpiTrace::Clear();
+			return "trace cleared";
+		}
+		if (*Option)
+		{
+			ReplyCode = 501;
+			return cString::sprintf("unknown option '%s'", Option);
+		}
+		return cRpiTrace::Dump();
+	}
+	if (!strcasecmp(Command, "TRACEJSON"))
+	{
+		if (!*Option)
+		{
+			ReplyCode = 501;
+			return "missing file name";
+		}
+		if (!cRpiTrace::WriteChromeTrace(Option))
+		{
+			ReplyCode = 550;
+			return cString::sprintf("failed to write trace to %s", Option);
+		}
+		return cString::sprintf("trace written to %s", Option);
+	}
+	if (!strcasecmp(Command, "OVGSTAT"))
+	{
+		if (!strcasecmp(Option, "CLEAR"))
+		{
+			cRpiOsdProvider::ClearProfile();
+			return "OSD statistics cleared";
+		}
+		if (*Option && strcasecmp(Option, "HIST"))
+		{
+			ReplyCode = 501;
+			return cString::sprintf("unknown option '%s'", Option);
+		}
+		return cRpiOsdProvider::GetProfile(*Option);
+	}
+	if (!strcasecmp(Command, "AUDIOSTAT"))
+	{
+		if (!strcasecmp(Option, "CLEAR"))
+		{
+			m_device->ResetAudioStats();
+			return "audio statistics cleared";
+		}
+		if (*Option)
+		{
+			ReplyCode = 501;
+			return cString::sprintf("unknown option '%s'", Option);
+		}
+		return m_device->GetAudioStats();
+	}
+	if (!strcasecmp(Command, "OVGREC"))
+	{
+		if (!*Option)
+		{
+			ReplyCode = 501;
+			return "missing file name";
+		}
+		if (!strcasecmp(Option, "STOP"))
+		{
+			int count = cRpiOsdProvider::StopRecording();
+			if (count < 0)
+			{
+				ReplyCode = 550;
+				return "OSD commands are not being recorded";
+			}
+			return cString::sprintf("recorded %d OSD commands", count);
+		}
+		if (!cRpiOsdProvider::StartRecording(Option))
+		{
+			ReplyCode = 550;
+			return cString::sprintf("failed to record to %s", Option);
+		}
+		return cString::sprintf("recording OSD commands to %s", Option);
+	}
+	if (!strcasecmp(Command, "OVGPLAY"))
+	{
+		// FAST is taken from the end, so file names may contain spaces just
+		// as with OVGREC
+		char *fileName = strdup(Option);
+		char *last = strrchr(fileName, ' ');
+		bool fast = last && !strcasecmp(last + 1, "FAST");
+		if (fast)
+		{
+			*last = 0;
+			stripspace(fileName);
+		}
+
+		cString ret;
+		if (!*fileName)
+		{
+			ReplyCode = 501;
+			ret = "missing file name";
+		}
+		else if (!cRpiOsdProvider::Replay(fileName, !fast))
+		{
+			ReplyCode = 550;
+			ret = "OSD replay not possible";
+		}
+		else
+			ret = cString::sprintf("replaying OSD commands from %s", fileName);
+
+		free(fileName);
+		return ret;
+	}
+	return NULL;
+}
+
 VDRPLUGINCREATOR(cPluginRpiHdDevice); // Don't touch this! okay.
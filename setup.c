@@ -30,6 +30,10 @@
 #include "interface/vchiq_arm/vchiq_if.h"
 #include "interface/vmcs_host/vc_tvservice.h"
 
+#define AUDIO_DELAY_MAX 500
+#define AUDIO_LATENCY_TARGET_MIN 50
+#define AUDIO_LATENCY_TARGET_MAX 1000
+
 /* ------------------------------------------------------------------------- */
 
 class cRpiSetupPage : public cMenuSetupPage
@@ -103,6 +107,11 @@ protected:
 	{
 		SetupStore("AudioPort", m_audio.port);
 		SetupStore("AudioFormat", m_audio.format);
+		SetupStore("AudioDelayAnalog", m_audio.analogDelay);
+		SetupStore("AudioDelayHDMI", m_audio.hdmiDelay);
+		SetupStore("CompensateLatency", m_audio.compensateLatency);
+		SetupStore("AudioLatencyTarget", m_audio.latencyTarget);
+		SetupStore("AudioOutputThread", m_audio.outputThread);
 
 		SetupStore("VideoFraming", m_video.framing);
 		SetupStore("Resolution", m_video.resolution);
@@ -110,6 +119,7 @@ protected:
 		SetupStore("AdvancedDeinterlacer", m_video.advancedDeinterlacer);
 
 		SetupStore("AcceleratedOsd", m_osd.accelerated);
+		SetupStore("PerformanceOverlay", m_osd.perfOverlay);
 
 		cRpiSetup::GetInstance()->Set(m_audio, m_video, m_osd);
 }
@@ -147,9 +157,26 @@ private:
 					&m_audio.format, 3, m_audioFormat));
 		}
 
+		Add(new cMenuEditIntItem(tr("Audio Delay (ms)"),
+				m_audio.port == 1 ? &m_audio.hdmiDelay : &m_audio.analogDelay,
+				-AUDIO_DELAY_MAX, AUDIO_DELAY_MAX));
+
+		Add(new cMenuEditBoolItem(
+				tr("Compensate TV Latency"), &m_audio.compensateLatency));
+
+		Add(new cMenuEditIntItem(tr("Audio Latency Target (ms)"),
+				&m_audio.latencyTarget,
+				AUDIO_LATENCY_TARGET_MIN, AUDIO_LATENCY_TARGET_MAX));
+
+		Add(new cMenuEditBoolItem(
+				tr("Audio Output Thread"), &m_audio.outputThread));
+
 		Add(new cMenuEditBoolItem(
 				tr("Use GPU accelerated OSD"), &m_osd.accelerated));
 
+		Add(new cMenuEditBoolItem(
+				tr("Show Performance Overlay"), &m_osd.perfOverlay));
+
 		SetCurrent(Get(current));
 		Display();
 	}
@@ -219,12 +246,41 @@ void cRpiSetup::SetVideoSetupChangedCallback(void (*callback)(void*), void* data
 	GetInstance()->m_onVideoSetupChangedData = data;
 }
 
+void cRpiSetup::SetSinkLatency(int video, int audio)
+{
+	cRpiSetup *instance = GetInstance();
+	instance->m_audioDelayMutex.Lock();
+	instance->m_sinkVideoLatency = video;
+	instance->m_sinkAudioLatency = audio;
+	instance->UpdateAudioDelay();
+	instance->m_audioDelayMutex.Unlock();
+}
+
+void cRpiSetup::UpdateAudioDelay(void)
+{
+	m_audioDelayMutex.Lock();
+	int delay = m_audio.port ? m_audio.hdmiDelay : m_audio.analogDelay;
+
+	// audio has to wait for the TV's video processing, but when it's output
+	// via HDMI, the sink's own audio latency has already been spent
+	if (m_audio.compensateLatency && m_sinkVideoLatency >= 0)
+		delay += m_sinkVideoLatency - (m_audio.port &&
+				m_sinkAudioLatency >= 0 ? m_sinkAudioLatency : 0);
+
+	m_audioDelay = delay;
+	m_audioDelayMutex.Unlock();
+}
+
 bool cRpiSetup::IsAudioFormatSupported(cAudioCodec::eCodec codec,
 		int channels, int samplingRate)
 {
+#ifndef ENABLE_IEC61937
 	// MPEG-1 layer 2 audio pass-through not supported by audio render
-	// and AAC audio pass-through not yet working
-	if (codec == cAudioCodec::eMPG || codec == cAudioCodec::eAAC)
+	if (codec == cAudioCodec::eMPG)
+		return false;
+#endif
+	// AAC audio pass-through not yet working
+	if (codec == cAudioCodec::eAAC)
 		return false;
 
 	if (channels < 2 || channels > 6)
@@ -233,21 +289,10 @@ bool cRpiSetup::IsAudioFormatSupported(cAudioCodec::eCodec codec,
 	switch (GetAudioFormat())
 	{
 	case cAudioFormat::ePassThrough:
-		return (vc_tv_hdmi_audio_supported(
-					codec == cAudioCodec::eMPG  ? EDID_AudioFormat_eMPEG1 :
-					codec == cAudioCodec::eAC3  ? EDID_AudioFormat_eAC3   :
-					codec == cAudioCodec::eEAC3 ? EDID_AudioFormat_eEAC3  :
-					codec == cAudioCodec::eAAC  ? EDID_AudioFormat_eAAC   :
-					codec == cAudioCodec::eDTS  ? EDID_AudioFormat_eDTS   :
-							EDID_AudioFormat_ePCM, channels,
-					samplingRate ==  32000 ? EDID_AudioSampleRate_e32KHz  :
-					samplingRate ==  44100 ? EDID_AudioSampleRate_e44KHz  :
-					samplingRate ==  88200 ? EDID_AudioSampleRate_e88KHz  :
-					samplingRate ==  96000 ? EDID_AudioSampleRate_e96KHz  :
-					samplingRate == 176000 ? EDID_AudioSampleRate_e176KHz :
-					samplingRate == 192000 ? EDID_AudioSampleRate_e192KHz :
-							EDID_AudioSampleRate_e48KHz,
-							EDID_AudioSampleSize_16bit) == 0);
+		// looked up in the capabilities the firmware reported after the
+		// last hotplug event, so no TV service call is needed here
+		return cRpiDisplay::IsAudioFormatSupported(codec, channels,
+				samplingRate);
 
 	case cAudioFormat::eMultiChannelPCM:
 		return codec == cAudioCodec::ePCM;
@@ -312,6 +357,17 @@ bool cRpiSetup::Parse(const char *name, const char *value)
 		m_audio.port = atoi(value);
 	else if (!strcasecmp(name, "AudioFormat"))
 		m_audio.format = atoi(value);
+	else if (!strcasecmp(name, "AudioDelayAnalog"))
+		m_audio.analogDelay = atoi(value);
+	else if (!strcasecmp(name, "AudioDelayHDMI"))
+		m_audio.hdmiDelay = atoi(value);
+	else if (!strcasecmp(name, "CompensateLatency"))
+		m_audio.compensateLatency = atoi(value);
+	else if (!strcasecmp(name, "AudioLatencyTarget"))
+		m_audio.latencyTarget = constrain(atoi(value),
+				AUDIO_LATENCY_TARGET_MIN, AUDIO_LATENCY_TARGET_MAX);
+	else if (!strcasecmp(name, "AudioOutputThread"))
+		m_audio.outputThread = atoi(value);
 	else if (!strcasecmp(name, "VideoFraming"))
 		m_video.framing = atoi(value);
 	else if (!strcasecmp(name, "Resolution"))
@@ -322,20 +378,24 @@ bool cRpiSetup::Parse(const char *name, const char *value)
 		m_video.advancedDeinterlacer = atoi(value);
 	else if (!strcasecmp(name, "AcceleratedOsd"))
 		m_osd.accelerated = atoi(value);
+	else if (!strcasecmp(name, "PerformanceOverlay"))
+		m_osd.perfOverlay = atoi(value);
 	else return false;
 
+	UpdateAudioDelay();
 	return true;
 }
 
 void cRpiSetup::Set(AudioParameters audio, VideoParameters video,
 		OsdParameters osd)
 {
-	if (audio != m_audio)
-	{
-		m_audio = audio;
-		if (m_onAudioSetupChanged)
-			m_onAudioSetupChanged(m_onAudioSetupChangedData);
-	}
+	bool audioChanged = audio != m_audio;
+	m_audioDelayMutex.Lock();
+	m_audio = audio;
+	UpdateAudioDelay();
+	m_audioDelayMutex.Unlock();
+	if (audioChanged && m_onAudioSetupChanged)
+		m_onAudioSetupChanged(m_onAudioSetupChangedData);
 
 	if (video != m_video)
 	{
@@ -37,11 +37,23 @@ public:
 	{
 		AudioParameters() :
 			port(0),
-			format(0) { }
+			format(0),
+			analogDelay(0),
+			hdmiDelay(0),
+			compensateLatency(1),
+			latencyTarget(200),
+			outputThread(0) { }
 
 		int port;
 		int format;
-
+		int analogDelay;
+		int hdmiDelay;
+		int compensateLatency;
+		int latencyTarget;
+		int outputThread;
+
+		// the audio delay, latency target and output thread are applied
+		// without reconfiguring the render
 		bool operator!=(const AudioParameters& a) {
 			return (a.port != port) || (a.format != format);
 		}
@@ -70,12 +82,14 @@ public:
 	struct OsdParameters
 	{
 		OsdParameters() :
-			accelerated(1) { }
+			accelerated(1), perfOverlay(0) { }
 
 		int accelerated;
+		int perfOverlay;
 
 		bool operator!=(const OsdParameters& a) {
-			return (a.accelerated != accelerated);
+			return (a.accelerated != accelerated) ||
+					(a.perfOverlay != perfOverlay);
 		}
 	};
 
@@ -137,6 +151,24 @@ public:
 						(width * height <= 576 * 720 ? true : false) : true;
 	}
 
+	// delay of audio against video in ms for the current audio port,
+	// negative values delay the video
+	static int GetAudioDelay(void) {
+		return GetInstance()->m_audioDelay;
+	}
+
+	// video and audio latency of the HDMI sink in ms, -1 if unknown
+	static void SetSinkLatency(int video, int audio);
+
+	// amount of decoded audio in ms staged ahead of the audio render
+	static int GetAudioLatencyTarget(void) {
+		return GetInstance()->m_audio.latencyTarget;
+	}
+
+	static bool IsAudioOutputThread(void) {
+		return GetInstance()->m_audio.outputThread != 0;
+	}
+
 	static bool IsAudioFormatSupported(cAudioCodec::eCodec codec,
 			int channels, int samplingRate);
 
@@ -149,6 +181,10 @@ public:
 		return GetInstance()->m_osd.accelerated != 0;
 	}
 
+	static bool IsPerfOverlay(void) {
+		return GetInstance()->m_osd.perfOverlay != 0;
+	}
+
 	static bool HasOsd(void) {
 		return GetInstance()->m_plugin.hasOsd;
 	}
@@ -183,6 +219,9 @@ public:
 
 	cRpiSetup() :
 		m_mpeg2Enabled(false),
+		m_sinkVideoLatency(-1),
+		m_sinkAudioLatency(-1),
+		m_audioDelay(0),
 		m_onAudioSetupChanged(0),
 		m_onAudioSetupChangedData(0),
 		m_onVideoSetupChanged(0),
@@ -199,6 +238,15 @@ private:
 
 	bool m_mpeg2Enabled;
 
+	// the audio delay is looked up for each PES, so it's only calculated
+	// when the setup or the sink latency has changed
+	void UpdateAudioDelay(void);
+
+	int m_sinkVideoLatency;
+	int m_sinkAudioLatency;
+	std::atomic<int> m_audioDelay;
+	cMutex m_audioDelayMutex;
+
 	void (*m_onAudioSetupChanged)(void*);
 	void *m_onAudioSetupChangedData;
 
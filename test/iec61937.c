@@ -0,0 +1,265 @@
+/*
+ * rpihddevice - VDR HD output device for Raspberry Pi
+ * Copyright (C) 2014, 2015, 2016 Thomas Reufer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "test.h"
+
+// the packer logs dropped frames, which is done by VDR otherwise
+static int s_errors = 0;
+void esyslog(const char *fmt, ...) { s_errors++; }
+
+#include "iec61937.h"
+
+#include <vector>
+
+typedef std::vector<uint8_t> Buffer;
+
+// builds a frame of the given size, starting with the header bytes and
+// followed by a counting pattern
+static Buffer Frame(const uint8_t *header, unsigned int headerSize,
+		unsigned int size)
+{
+	Buffer frame(size);
+	for (unsigned int i = 0; i < size; i++)
+		frame[i] = i < headerSize ? header[i] : (uint8_t)(i * 7 + 3);
+	return frame;
+}
+
+// builds the expected burst independently of the packer: little endian
+// preamble words, the payload swapped to little endian words with an odd
+// byte in the upper half of the last word and zeros up to the period
+static Buffer Reference(uint16_t pc, uint16_t pd, const Buffer &payload,
+		unsigned int period)
+{
+	Buffer burst(period, 0);
+	const uint16_t preamble[4] = { 0xF872, 0x4E1F, pc, pd };
+	for (int i = 0; i < 4; i++)
+	{
+		burst[2 * i] = preamble[i] & 0xFF;
+		burst[2 * i + 1] = preamble[i] >> 8;
+	}
+	for (unsigned int i = 0; i < payload.size(); i++)
+		burst[IEC61937_PREAMBLE + (i ^ 1)] = payload[i];
+	return burst;
+}
+
+static Buffer ReadBurst(cRpiIec61937 &iec)
+{
+	Buffer burst;
+	uint8_t chunk[1000];
+	while (iec.HasBurst())
+	{
+		unsigned int size = iec.Read(chunk, sizeof(chunk));
+		burst.insert(burst.end(), chunk, chunk + size);
+	}
+	return burst;
+}
+
+static void TestAc3(void)
+{
+	// bsid 8, bit stream mode 2
+	const uint8_t header[] = { 0x0B, 0x77, 0x12, 0x34, 0x00, 0x42 };
+	cRpiIec61937 iec;
+
+	Buffer frame = Frame(header, sizeof(header), 100);
+	CHECK(iec.Add(cAudioCodec::eAC3, &frame[0], frame.size(), 1000));
+	CHECK(iec.HasBurst());
+	CHECK(iec.GetPts() == 1000);
+
+	// burst has to be read before the next frame can be added
+	CHECK(!iec.Add(cAudioCodec::eAC3, &frame[0], frame.size(), 2000));
+
+	Buffer burst = ReadBurst(iec);
+	CHECK(burst.size() == 1536 * 4);
+	CHECK(burst == Reference(0x0201, 100 * 8, frame, 1536 * 4));
+	CHECK(burst[4] == 0x01 && burst[5] == 0x02);
+	CHECK(burst[8] == 0x77 && burst[9] == 0x0B);
+	CHECK(!iec.HasBurst());
+}
+
+static void TestAc3OddSize(void)
+{
+	const uint8_t header[] = { 0x0B, 0x77, 0x12, 0x34, 0x00, 0x40 };
+	cRpiIec61937 iec;
+
+	// odd frames are padded to a full word, which is counted in the length
+	Buffer frame = Frame(header, sizeof(header), 101);
+	CHECK(iec.Add(cAudioCodec::eAC3, &frame[0], frame.size(), 1000));
+
+	Buffer padded = frame;
+	padded.push_back(0);
+	Buffer burst = ReadBurst(iec);
+	CHECK(burst == Reference(0x0001, 102 * 8, padded, 1536 * 4));
+	CHECK(burst[IEC61937_PREAMBLE + 100] == 0);
+	CHECK(burst[IEC61937_PREAMBLE + 101] == frame[100]);
+}
+
+static void TestEac3SixBlocks(void)
+{
+	// independent substream 0, six audio blocks
+	const uint8_t header[] = { 0x0B, 0x77, 0x00, 0x63, 0x30, 0x40 };
+	cRpiIec61937 iec;
+
+	// a frame covering six blocks completes its burst right away
+	Buffer frame = Frame(header, sizeof(header), 200);
+	CHECK(iec.Add(cAudioCodec::eEAC3, &frame[0], frame.size(), 1000));
+	CHECK(iec.HasBurst());
+	CHECK(iec.GetPts() == 1000);
+
+	// E-AC-3 bursts carry their length in bytes
+	Buffer burst = ReadBurst(iec);
+	CHECK(burst.size() == IEC61937_MAX_BURST);
+	CHECK(burst == Reference(0x0015, 200, frame, IEC61937_MAX_BURST));
+}
+
+static void TestEac3OneBlock(void)
+{
+	const uint8_t independent[] = { 0x0B, 0x77, 0x00, 0x18, 0x00, 0x40 };
+	const uint8_t dependent[]   = { 0x0B, 0x77, 0x40, 0x18, 0x00, 0x40 };
+	cRpiIec61937 iec;
+
+	// dependent substream without a preceding frame is dropped
+	Buffer frame = Frame(dependent, sizeof(dependent), 50);
+	CHECK(iec.Add(cAudioCodec::eEAC3, &frame[0], frame.size(), 500));
+	CHECK(!iec.HasBurst());
+
+	// six one-block frames form a burst, a dependent substream in between
+	// belongs to its preceding frame and doesn't count any blocks
+	Buffer payload;
+	for (int i = 0; i < 6; i++)
+	{
+		frame = Frame(independent, sizeof(independent), 50 + 2 * i);
+		CHECK(iec.Add(cAudioCodec::eEAC3, &frame[0], frame.size(), 1000 + i));
+		payload.insert(payload.end(), frame.begin(), frame.end());
+		if (i == 2)
+		{
+			frame = Frame(dependent, sizeof(dependent), 40);
+			CHECK(iec.Add(cAudioCodec::eEAC3, &frame[0], frame.size(), 0));
+			payload.insert(payload.end(), frame.begin(), frame.end());
+		}
+		CHECK(iec.HasBurst() == (i == 5));
+	}
+
+	CHECK(iec.GetPts() == 1000);
+	Buffer burst = ReadBurst(iec);
+	CHECK(burst == Reference(0x0015, payload.size(), payload,
+			IEC61937_MAX_BURST));
+}
+
+static void TestDts512(void)
+{
+	// 16 blocks of 32 samples
+	const uint8_t header[] = { 0x7F, 0xFE, 0x80, 0x01, 0x00, 0x3C };
+	cRpiIec61937 iec;
+
+	Buffer frame = Frame(header, sizeof(header), 1006);
+	CHECK(iec.Add(cAudioCodec::eDTS, &frame[0], frame.size(), 1000));
+
+	Buffer burst = ReadBurst(iec);
+	CHECK(burst.size() == 512 * 4);
+	CHECK(burst == Reference(0x000B, 1006 * 8, frame, 512 * 4));
+
+	// a frame filling the whole period is sent without preamble
+	frame = Frame(header, sizeof(header), 512 * 4);
+	CHECK(iec.Add(cAudioCodec::eDTS, &frame[0], frame.size(), 2000));
+	CHECK(iec.GetPts() == 2000);
+
+	burst = ReadBurst(iec);
+	CHECK(burst.size() == 512 * 4);
+	CHECK(burst[0] == 0xFE && burst[1] == 0x7F);
+	CHECK(burst[2047] == frame[2046] && burst[2046] == frame[2047]);
+
+	// frames with other sample counts can't be packed
+	const uint8_t invalid[] = { 0x7F, 0xFE, 0x80, 0x01, 0x00, 0x1C };
+	int errors = s_errors;
+	frame = Frame(invalid, sizeof(invalid), 500);
+	CHECK(iec.Add(cAudioCodec::eDTS, &frame[0], frame.size(), 3000));
+	CHECK(!iec.HasBurst());
+	CHECK(s_errors == errors + 1);
+}
+
+static void TestMpeg(void)
+{
+	// MPEG-1 layer 2
+	const uint8_t mpeg1[] = { 0xFF, 0xFD, 0x94, 0x00 };
+	// MPEG-2 LSF layer 2
+	const uint8_t mpeg2[] = { 0xFF, 0xF5, 0x84, 0x00 };
+	cRpiIec61937 iec;
+
+	Buffer frame = Frame(mpeg1, sizeof(mpeg1), 384);
+	CHECK(iec.Add(cAudioCodec::eMPG, &frame[0], frame.size(), 1000));
+	Buffer burst = ReadBurst(iec);
+	CHECK(burst.size() == 1152 * 4);
+	CHECK(burst == Reference(0x0005, 384 * 8, frame, 1152 * 4));
+
+	frame = Frame(mpeg2, sizeof(mpeg2), 144);
+	CHECK(iec.Add(cAudioCodec::eMPG, &frame[0], frame.size(), 2000));
+	burst = ReadBurst(iec);
+	CHECK(burst.size() == 1152 * 2 * 4);
+	CHECK(burst == Reference(0x0009, 144 * 8, frame, 1152 * 2 * 4));
+}
+
+static void TestSamplingRate(void)
+{
+	CHECK(cRpiIec61937::GetSamplingRate(cAudioCodec::eAC3, 48000) == 48000);
+	CHECK(cRpiIec61937::GetSamplingRate(cAudioCodec::eEAC3, 48000) == 192000);
+	CHECK(cRpiIec61937::GetSamplingRate(cAudioCodec::eDTS, 44100) == 44100);
+	CHECK(cRpiIec61937::GetSamplingRate(cAudioCodec::eMPG, 48000) == 48000);
+	CHECK(cRpiIec61937::GetSamplingRate(cAudioCodec::eMPG, 24000) == 48000);
+
+	CHECK(cRpiIec61937::IsSupported(cAudioCodec::eEAC3));
+	CHECK(!cRpiIec61937::IsSupported(cAudioCodec::eAAC));
+}
+
+static void TestReadAndReset(void)
+{
+	const uint8_t header[] = { 0x0B, 0x77, 0x12, 0x34, 0x00, 0x40 };
+	cRpiIec61937 iec;
+
+	Buffer frame = Frame(header, sizeof(header), 100);
+	CHECK(iec.Add(cAudioCodec::eAC3, &frame[0], frame.size(), 1000));
+
+	// only the first chunk of a burst carries the PTS
+	uint8_t chunk[4096];
+	CHECK(iec.GetPts() == 1000);
+	CHECK(iec.Read(chunk, 4096) == 4096);
+	CHECK(iec.GetPts() == OMX_INVALID_PTS);
+	CHECK(iec.Read(chunk, 4096) == 1536 * 4 - 4096);
+	CHECK(!iec.HasBurst());
+
+	// reset drops a pending burst
+	CHECK(iec.Add(cAudioCodec::eAC3, &frame[0], frame.size(), 2000));
+	iec.Reset();
+	CHECK(!iec.HasBurst());
+	CHECK(iec.Add(cAudioCodec::eAC3, &frame[0], frame.size(), 3000));
+	CHECK(iec.GetPts() == 3000);
+}
+
+int main(void)
+{
+	TestAc3();
+	TestAc3OddSize();
+	TestEac3SixBlocks();
+	TestEac3OneBlock();
+	TestDts512();
+	TestMpeg();
+	TestSamplingRate();
+	TestReadAndReset();
+
+	return TEST_RESULT("iec61937");
+}
@@ -0,0 +1,159 @@
+/*
+ * rpihddevice - VDR HD output device for Raspberry Pi
+ * Copyright (C) 2014, 2015, 2016 Thomas Reufer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "test.h"
+#include "ptsqueue.h"
+
+#define INVALID -1
+
+typedef cPtsQueue<4, INVALID> Queue;
+
+static void TestConsume(void)
+{
+	Queue q;
+	CHECK(q.empty());
+
+	q.push(1000, 100, 1);
+	q.push(2000, 50, 2);
+	CHECK(!q.empty());
+	CHECK(q.front().pts == 1000);
+	CHECK(q.front().time == 1);
+
+	// partially consumed PES keeps its entry, but not its PTS
+	q.consume(30, false);
+	CHECK(q.front().pts == INVALID);
+	CHECK(q.front().end == 100);
+
+	// completely consumed PES is dropped, the next one is untouched
+	q.consume(70, false);
+	CHECK(q.front().pts == 2000);
+	CHECK(q.front().time == 2);
+	CHECK(q.consumed() == 100);
+
+	q.consume(50, false);
+	CHECK(q.empty());
+}
+
+static void TestConsumeSeveral(void)
+{
+	Queue q;
+	q.push(1000, 10, 0);
+	q.push(2000, 10, 0);
+	q.push(3000, 10, 0);
+
+	// a frame spanning several PES drops all completed ones
+	q.consume(25, false);
+	CHECK(!q.empty());
+	CHECK(q.front().pts == INVALID);
+	CHECK(q.front().end == 30);
+
+	// a PES ending exactly at the consumed offset is the last one dropped
+	q.push(4000, 10, 0);
+	q.consume(5, false);
+	CHECK(q.front().pts == 4000);
+}
+
+static void TestRetainPts(void)
+{
+	Queue q;
+	q.push(1000, 100, 0);
+
+	// skipping garbage in front of a frame keeps the PES' time stamp
+	q.consume(10, true);
+	CHECK(q.front().pts == 1000);
+
+	// still dropped once consumed completely
+	q.consume(90, true);
+	CHECK(q.empty());
+}
+
+static void TestWraparound(void)
+{
+	Queue q;
+	int64_t next = 0, expected = 0;
+
+	// keep two or three entries pending while the head wraps several times
+	q.push(next++, 10, 0);
+	q.push(next++, 10, 0);
+	for (int i = 0; i < 20; i++)
+	{
+		q.push(next++, 10, 0);
+		CHECK(q.front().pts == expected);
+		q.consume(10, false);
+		expected++;
+	}
+	CHECK(q.front().pts == expected);
+	CHECK(q.front().end == q.consumed() + 10);
+
+	q.consume(20, false);
+	CHECK(q.empty());
+	CHECK(q.consumed() == 220);
+}
+
+static void TestFull(void)
+{
+	Queue q;
+	for (int i = 0; i < 4; i++)
+	{
+		CHECK(!q.full());
+		q.push(i * 1000, 10, 0);
+	}
+	CHECK(q.full());
+
+	// room for exactly one more PES after consuming one
+	q.consume(10, false);
+	CHECK(!q.full());
+	q.push(4000, 10, 0);
+	CHECK(q.full());
+
+	// entries come out in order across the wrapped ring
+	for (int i = 1; i <= 4; i++)
+	{
+		CHECK(q.front().pts == i * 1000);
+		q.consume(10, false);
+	}
+	CHECK(q.empty());
+	CHECK(!q.full());
+}
+
+static void TestClear(void)
+{
+	Queue q;
+	q.push(1000, 10, 0);
+	q.push(2000, 10, 0);
+	q.consume(15, false);
+	q.clear();
+	CHECK(q.empty());
+	CHECK(q.consumed() == 0);
+
+	// offsets restart from zero
+	q.push(3000, 10, 0);
+	CHECK(q.front().end == 10);
+}
+
+int main(void)
+{
+	TestConsume();
+	TestConsumeSeveral();
+	TestRetainPts();
+	TestWraparound();
+	TestFull();
+	TestClear();
+	return TEST_RESULT("ptsqueue");
+}
@@ -0,0 +1,43 @@
+/*
+ * rpihddevice - VDR HD output device for Raspberry Pi
+ * Copyright (C) 2014, 2015, 2016 Thomas Reufer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+// minimal checks for the host unit tests, which run without VDR
+
+static int s_failures = 0;
+
+#define CHECK(x) \
+	do { \
+		if (!(x)) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s\n", \
+					__FILE__, __LINE__, #x); \
+			s_failures++; \
+		} \
+	} while (0)
+
+#define TEST_RESULT(name) \
+	(printf("%s: %s\n", name, s_failures ? "FAILED" : "passed"), \
+			s_failures ? 1 : 0)
+
+#endif
@@ -18,6 +18,7 @@
  */
 
 #include <limits.h>
+#include <time.h>
 #include <vdr/tools.h>
 #include "tools.h"
 #include <algorithm>
@@ -109,3 +110,10 @@ int cRational::Gcd(int u, int v)
 
     return Gcd((v - u) >> 1, u);
 }
+
+int64_t cTimeUs::Now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -20,6 +20,8 @@
 #ifndef TOOLS_H
 #define TOOLS_H
 
+#include <stdint.h>
+
 #define ELOG(a...) esyslog("rpihddevice: " a)
 #define ILOG(a...) isyslog("rpihddevice: " a)
 #define DLOG(a...) dsyslog("rpihddevice: " a)
@@ -30,6 +32,8 @@
 #define DBG(a...)  void()
 #endif
 
+#define OMX_INVALID_PTS -1
+
 class cVideoResolution
 {
 public:
@@ -233,4 +237,36 @@ private:
 	static int Gcd(int u, int v);
 };
 
+class cTimeUs
+{
+public:
+
+	// monotonic time in microseconds
+	static int64_t Now(void);
+};
+
+/* ------------------------------------------------------------------------- */
+
+// snapshot of the A/V pipeline state, counters are cumulative
+
+struct tPipelineStats
+{
+	bool hasAudio;
+	bool hasVideo;
+
+	int audioBuffer;        // buffer usage in %
+	int videoBuffer;
+	int audioBufferedMs;    // written PTS ahead of STC
+	int audioStagedMs;      // decoded audio waiting for a render buffer
+	int audioLatencyTargetMs;
+	int videoBufferedMs;
+	int avOffsetMs;         // last written video PTS - audio PTS
+	int liveSpeed;          // -2 .. +2, 0 means no correction
+
+	unsigned int decodedFrames;
+	unsigned int droppedFrames;
+
+	int64_t audioCpuTimeUs; // CPU time consumed by audio decoder thread
+};
+
 #endif
@@ -0,0 +1,174 @@
+/*
+ * rpihddevice - VDR HD output device for Raspberry Pi
+ * Copyright (C) 2014, 2015, 2016 Thomas Reufer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "trace.h"
+#include "tools.h"
+
+#include <vdr/thread.h>
+
+#include <atomic>
+#include <string>
+#include <stdio.h>
+#include <unistd.h>
+
+// number of ring entries, must be a power of two
+#define TRACE_SIZE 1024
+
+/*
+ * Each slot is protected by a sequence number, which is cleared while the
+ * slot is written and set to (index + 1) when the entry is complete. Readers
+ * only take entries whose sequence number didn't change while copying, so
+ * writers never have to wait for anybody.
+ */
+
+struct tTraceSlot
+{
+	std::atomic<uint32_t> seq;
+	std::atomic<int64_t>  time;
+	std::atomic<int>      event;
+	std::atomic<int>      data;
+	std::atomic<int>      tid;
+};
+
+struct tTraceEntry
+{
+	int64_t time;
+	int     event;
+	int     data;
+	int     tid;
+};
+
+static tTraceSlot s_ring[TRACE_SIZE];
+static std::atomic<uint32_t> s_next(0);
+static std::atomic<uint32_t> s_first(0);
+
+void cRpiTrace::Add(eEvent event, int data)
+{
+	static thread_local int tid = cThread::ThreadId();
+
+	uint32_t n = s_next.fetch_add(1, std::memory_order_relaxed);
+	tTraceSlot &slot = s_ring[n & (TRACE_SIZE - 1)];
+
+	slot.seq.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	slot.time.store(cTimeUs::Now(), std::memory_order_relaxed);
+	slot.event.store(event, std::memory_order_relaxed);
+	slot.data.store(data, std::memory_order_relaxed);
+	slot.tid.store(tid, std::memory_order_relaxed);
+
+	slot.seq.store(n + 1, std::memory_order_release);
+}
+
+void cRpiTrace::Clear(void)
+{
+	s_first.store(s_next.load(std::memory_order_acquire),
+			std::memory_order_relaxed);
+}
+
+static int GetEntries(tTraceEntry *entries)
+{
+	uint32_t next = s_next.load(std::memory_order_acquire);
+	uint32_t n = s_first.load(std::memory_order_relaxed);
+	if (next - n > TRACE_SIZE)
+		n = next - TRACE_SIZE;
+
+	int count = 0;
+	for (; n != next; n++)
+	{
+		tTraceSlot &slot = s_ring[n & (TRACE_SIZE - 1)];
+
+		uint32_t seq = slot.seq.load(std::memory_order_acquire);
+		if (seq != n + 1)
+			continue;
+
+		tTraceEntry &entry = entries[count];
+		entry.time = slot.time.load(std::memory_order_relaxed);
+		entry.event = slot.event.load(std::memory_order_relaxed);
+		entry.data = slot.data.load(std::memory_order_relaxed);
+		entry.tid = slot.tid.load(std::memory_order_relaxed);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.seq.load(std::memory_order_relaxed) == seq)
+			count++;
+	}
+	return count;
+}
+
+cString cRpiTrace::Dump(void)
+{
+	tTraceEntry *entries = new tTraceEntry[TRACE_SIZE];
+	int count = GetEntries(entries);
+
+	std::string ret;
+	char line[128];
+	for (int i = 0; i < count; i++)
+	{
+		// time relative to the first entry and to the previous one in ms
+		snprintf(line, sizeof(line), "%10.3f %+9.3f %6d %-20s %d\n",
+				(entries[i].time - entries[0].time) / 1000.0,
+				i ? (entries[i].time - entries[i - 1].time) / 1000.0 : 0.0,
+				entries[i].tid, Str((eEvent)entries[i].event),
+				entries[i].data);
+		ret += line;
+	}
+	delete[] entries;
+
+	if (!count)
+		return "trace is empty";
+
+	// SVDRP replies must not end with a line break
+	ret.resize(ret.size() - 1);
+	return cString(ret.c_str());
+}
+
+bool cRpiTrace::WriteChromeTrace(const char *fileName)
+{
+	FILE *f = fopen(fileName, "w");
+	if (!f)
+	{
+		ELOG("failed to open %s for writing trace!", fileName);
+		return false;
+	}
+
+	tTraceEntry *entries = new tTraceEntry[TRACE_SIZE];
+	int count = GetEntries(entries);
+
+	// instant events according to the Trace Event Format, which can be loaded
+	// with chrome://tracing or https://ui.perfetto.dev
+	fprintf(f, "{\"traceEvents\":[");
+	for (int i = 0; i < count; i++)
+		fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"rpihddevice\",\"ph\":\"i\","
+				"\"s\":\"p\",\"ts\":%lld,\"pid\":%d,\"tid\":%d,"
+				"\"args\":{\"data\":%d}}", i ? "," : "",
+				Str((eEvent)entries[i].event), (long long)entries[i].time,
+				getpid(), entries[i].tid, entries[i].data);
+	fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+	delete[] entries;
+
+	bool ret = !ferror(f);
+	if (fclose(f) || !ret)
+	{
+		ELOG("failed to write trace to %s!", fileName);
+		return false;
+	}
+	DLOG("wrote %d trace events to %s", count, fileName);
+	return true;
+}
@@ -0,0 +1,82 @@
+/*
+ * rpihddevice - VDR HD output device for Raspberry Pi
+ * Copyright (C) 2014, 2015, 2016 Thomas Reufer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <vdr/tools.h>
+
+/*
+ * cRpiTrace records timestamped events of the A/V pipeline into a fixed-size
+ * ring, which allows to break down the time spent between e.g. a channel
+ * switch and the first rendered video frame. Recording an event is lock-free
+ * and only costs a clock read and a few stores, so tracing is always enabled.
+ */
+
+class cRpiTrace
+{
+
+public:
+
+	enum eEvent {
+		eSetPlayMode,
+		eFlushStreams,
+		eFirstAudioPes,
+		eFirstVideoPes,
+		eSetVideoCodec,
+		eStartClock,
+		ePortSettingsChanged,
+		eTunnelSetup,
+		eStreamStart,
+		eVideoRenderStart,
+		eDisplayUpdate,
+		eHdmiModeSet,
+		eHdmiEvent,
+		eNumEvents
+	};
+
+	static const char* Str(eEvent event) {
+		return	(event == eSetPlayMode)         ? "SetPlayMode"         :
+				(event == eFlushStreams)        ? "FlushStreams"        :
+				(event == eFirstAudioPes)       ? "FirstAudioPes"       :
+				(event == eFirstVideoPes)       ? "FirstVideoPes"       :
+				(event == eSetVideoCodec)       ? "SetVideoCodec"       :
+				(event == eStartClock)          ? "StartClock"          :
+				(event == ePortSettingsChanged) ? "PortSettingsChanged" :
+				(event == eTunnelSetup)         ? "TunnelSetup"         :
+				(event == eStreamStart)         ? "StreamStart"         :
+				(event == eVideoRenderStart)    ? "VideoRenderStart"    :
+				(event == eDisplayUpdate)       ? "DisplayUpdate"       :
+				(event == eHdmiModeSet)         ? "HdmiModeSet"         :
+				(event == eHdmiEvent)           ? "HdmiEvent"           :
+						"unknown";
+	}
+
+	static void Add(eEvent event, int data = 0);
+	static void Clear(void);
+
+	static cString Dump(void);
+	static bool WriteChromeTrace(const char *fileName);
+
+private:
+
+	cRpiTrace();
+};
+
+#endif